@@ -1,21 +1,29 @@
 #pragma once
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <functional>
 #include <fstream>
 #include <stdint.h>
 #include <vector>
-#include <list>
+#include <string_view>
 #include <stdexcept>
 #include <cassert>
 #include <optional>
+#include <variant>
 
+#include "annexb.hpp"
 #include "nalu.hpp"
+#include "sps.hpp"
 
 #include <boost/assert.hpp>
 
 #include "fixed_point.hpp"
+#include "byte_source.hpp"
+#include "fourcc.hpp"
+#include "byte_swap.hpp"
+#include "timing_table.hpp"
 
 // https://developer.apple.com/library/mac/documentation/QuickTime/QTFF/QTFFChap2/qtff2.html#//apple_ref/doc/uid/TP40000939-CH204-33303
 // what we want:
@@ -98,62 +106,31 @@ namespace my_remux::mp4
             return std::string(reinterpret_cast<const char*>(&type), 4);
         }
 
-        bool isType(const char* t) const
+        fourcc_t fourcc() const
         {
-            return 0 == strncmp((const char*)&type, t, 4);
+            return fourcc_t{type};
+        }
+
+        bool isType(fourcc_t t) const
+        {
+            return type == t.value;
+        }
+
+        const box_type_info_t* typeInfo() const
+        {
+            return find_box_type(fourcc());
         }
 
         bool isContainer() const
         {
-            return isType("moov") ||
-                   isType("moof") ||
-                   isType("trak") ||
-                   isType("traf") ||
-                   isType("mfra") ||
-                   isType("mvex") ||
-                   isType("mdia") ||
-                   isType("minf") ||
-                   isType("stbl") ||
-                   isType("stsd") ||
-                   isType("file") || // pseudo atom
-                   isType("dinf") ||
-                   isType("dref") ||
-                   isType("udta") ||
-                   isType("meta") ||
-                   isType("ilst") ||
-                   isType("edts") ||
-                   isType("avc1");
+            auto info = typeInfo();
+            return info && info->is_container;
         }
 
         size_t childOffset() const
         {
-            if (isType("stsd") || isType("dref"))
-            {
-                return 8; // uint32_t version_flags, uint32_t numChildren
-            }
-            else if (isType("meta"))
-            {
-                return 4; // uint32_t version_flags
-            }
-            else if (isType("avc1"))
-            {
-                return 78; // 6 bytes pad & 2 bytes index
-                           // version(2), revision(2), vendor(4),
-                           // temp quality(4), spat quality(4),
-                           // width(2), height(2), hppi(4), vppi(4)
-                           // data size(4, always 0)
-                           // frame count(2)
-                           // compressor name(4)
-                           // depth(2)
-                           // color table id (2)
-                           // color table (if any)
-                           // ...right?
-                           // actually taken from gdcl code, could not find it in any spec yet...
-            }
-            else
-            {
-                return 0;
-            }
+            auto info = typeInfo();
+            return info ? info->child_offset : 0;
         }
     };
 
@@ -163,12 +140,55 @@ namespace my_remux::mp4
         uint32_t flags;
     };
 
+    struct hvcC_t
+    {
+        struct array_t
+        {
+            bool array_completeness = true;
+            uint8_t nal_unit_type = 0;
+            std::vector<std::vector<char>> nalus;
+        };
+
+        uint8_t general_profile_space = 0;
+        bool general_tier_flag = false;
+        uint8_t general_profile_idc = 1;
+        uint32_t general_profile_compatibility_flags = 0;
+        uint64_t general_constraint_indicator_flags = 0; // 48 bits
+        uint8_t general_level_idc = 0;
+        uint16_t min_spatial_segmentation_idc = 0;
+        uint8_t parallelism_type = 0;
+        uint8_t chroma_format_idc = 1;
+        uint8_t bit_depth_luma_minus8 = 0;
+        uint8_t bit_depth_chroma_minus8 = 0;
+        uint16_t avg_frame_rate = 0;
+        uint8_t constant_frame_rate = 0;
+        uint8_t num_temporal_layers = 1;
+        bool temporal_id_nested = false;
+        int naluLengthFieldSize = 4;
+        std::vector<array_t> arrays; // usually vps, sps, pps
+
+        // first nalu of the given type, nullptr if there is none
+        const std::vector<char>* find_nalu(uint8_t nal_unit_type) const
+        {
+            for (auto& array : arrays)
+                if (array.nal_unit_type == nal_unit_type && !array.nalus.empty())
+                    return &array.nalus.front();
+            return nullptr;
+        }
+    };
+
     struct hev1_t
     {
+        uint16_t width = 0;
+        uint16_t height = 0;
+        hvcC_t hvcC;
     };
 
     struct hvc1_t
     {
+        uint16_t width = 0;
+        uint16_t height = 0;
+        hvcC_t hvcC;
     };
 
     struct avcC_t
@@ -185,15 +205,32 @@ namespace my_remux::mp4
         avcC_t avcC;
     };
 
-    struct stsd_t
+    // mpeg-4 elementary stream descriptor, for aac the decoder specific info
+    // is the AudioSpecificConfig
+    struct esds_t
+    {
+        uint16_t es_id = 0;
+        uint8_t object_type_indication = 0x40; // mpeg-4 audio
+        uint8_t stream_type = 0x05; // audio
+        uint32_t buffer_size = 0;
+        uint32_t max_bitrate = 0;
+        uint32_t avg_bitrate = 0;
+        std::vector<char> decoder_specific_info;
+    };
+
+    struct mp4a_t
     {
-        avc1_t avc1;
+        uint16_t channel_count = 2;
+        uint16_t sample_size = 16;
+        uint32_t sample_rate = 48000; // integer part of the 16.16 field
+        esds_t esds;
     };
 
-    struct tts_t
+    using sample_entry_t = std::variant<avc1_t, hvc1_t, hev1_t, mp4a_t>;
+
+    struct stsd_t
     {
-        uint32_t count;
-        int32_t duration;
+        sample_entry_t entry;
     };
 
     struct stss_t
@@ -211,9 +248,9 @@ namespace my_remux::mp4
     struct stbl_t
     {
         stsd_t stsd;
-        std::vector<tts_t> stts; // compressed dts
+        tts_table_t stts; // compressed dts
         stss_t stss; // keyframe indices
-        std::vector<tts_t> ctts; // dts -> pts mapping
+        tts_table_t ctts; // dts -> pts mapping
         std::vector<stc_t> stsc; // samples -> chunks mapping
         std::vector<uint32_t> stsz; // sample sizes
         std::vector<uint64_t> co64; // chunk offsets
@@ -284,8 +321,22 @@ namespace my_remux::mp4
         std::optional<uint32_t> default_sample_duration;
         std::optional<uint32_t> default_sample_size;
         std::optional<uint32_t> default_sample_flags;
+        bool default_base_is_moof = false;
     };
 
+    // sample flags as used in trex, tfhd and trun
+    inline constexpr uint32_t sample_depends_on_mask = 0x03000000;
+    inline constexpr uint32_t sample_depends_on_others = 0x01000000; // not an I picture
+    inline constexpr uint32_t sample_depends_on_none = 0x02000000; // I picture
+    inline constexpr uint32_t sample_is_non_sync = 0x00010000;
+
+    // some writers only set sample_depends_on, so a sample that claims to be
+    // sync but depends on others is not taken as a keyframe
+    inline constexpr bool is_sync_sample(uint32_t flags)
+    {
+        return !(flags & sample_is_non_sync) && (flags & sample_depends_on_mask) != sample_depends_on_others;
+    }
+
     struct trun_t
     {
         struct sample_t
@@ -321,9 +372,9 @@ namespace my_remux::mp4
 
     struct edit_t
     {
-        uint64_t duration;
-        uint64_t start_offset;
-        fixed_point_t<0x10000, int32_t> rate{1.0f};
+        uint64_t duration; // movie time scale
+        uint64_t start_offset; // media time, uint64_t(-1) for an empty edit
+        fixed_point_t<0x10000, int32_t> rate{1.0f}; // 0 for a dwell
     };
 
     struct edts_t
@@ -333,17 +384,28 @@ namespace my_remux::mp4
 
     struct hdlr_t
     {
-        /*
-        char hdlr[4];
-        char hdlr_type[4];
-        */
+        fourcc_t handler_type{"vide"}; // vide, soun or meta
         std::string description;
     };
 
+    // video media header
     struct vmhd_t
     {
     };
 
+    // sound media header
+    struct smhd_t
+    {
+        fixed_point_t<0x100, int16_t> balance{0.0f};
+    };
+
+    // null media header, for timed metadata
+    struct nmhd_t
+    {
+    };
+
+    using media_header_t = std::variant<vmhd_t, smhd_t, nmhd_t>;
+
     struct url_t
     {
     };
@@ -360,7 +422,7 @@ namespace my_remux::mp4
 
     struct minf_t
     {
-        vmhd_t vmhd;
+        media_header_t media_header;
         dinf_t dinf;
         stbl_t stbl;
     };
@@ -379,10 +441,25 @@ namespace my_remux::mp4
         mdia_t mdia;
     };
 
+    struct trex_t
+    {
+        uint32_t track_ID = 1;
+        uint32_t default_sample_description_index = 1;
+        uint32_t default_sample_duration = 0;
+        uint32_t default_sample_size = 0;
+        uint32_t default_sample_flags = 0;
+    };
+
+    struct mvex_t
+    {
+        std::vector<trex_t> trex;
+    };
+
     struct moov_t
     {
         mvhd_t mvhd;
-        trak_t trak;
+        std::vector<trak_t> traks;
+        std::optional<mvex_t> mvex; // present in fragmented files
     };
 
     struct udta_t
@@ -417,6 +494,25 @@ namespace my_remux::mp4
         return v;
     }
 
+    inline int16_t to_host(int16_t v)
+    {
+        char* p = reinterpret_cast<char*>(&v);
+        std::swap(p[0], p[1]);
+        return v;
+    }
+
+    inline uint64_t to_host(uint64_t v)
+    {
+        uint32_t hi = to_host(uint32_t(v >> 32));
+        uint32_t lo = to_host(uint32_t(v & 0xffffffff));
+        char* p = reinterpret_cast<char*>(&v);
+        char* p_hi = reinterpret_cast<char*>(&hi);
+        char* p_lo = reinterpret_cast<char*>(&lo);
+        std::copy(p_hi, p_hi + 4, p);
+        std::copy(p_lo, p_lo + 4, p + 4);
+        return v;
+    }
+
     template<typename T>
     inline T read_to_host(std::istream& file)
     {
@@ -428,20 +524,15 @@ namespace my_remux::mp4
     template<typename T>
     inline T read_to_host(const char* p)
     {
-        T x = *reinterpret_cast<const T*>(p);;
+        T x;
+        std::memcpy(&x, p, sizeof(x));
         return to_host(x);
     }
 
-    inline uint64_t to_host(uint64_t v)
+    template<typename T>
+    inline T read_to_host(byte_reader_t& file)
     {
-        uint32_t hi = to_host(uint32_t(v >> 32));
-        uint32_t lo = to_host(uint32_t(v & 0xffffffff));
-        char* p = reinterpret_cast<char*>(&v);
-        char* p_hi = reinterpret_cast<char*>(&hi);
-        char* p_lo = reinterpret_cast<char*>(&lo);
-        std::copy(p_hi, p_hi + 4, p);
-        std::copy(p_lo, p_lo + 4, p + 4);
-        return v;
+        return read_to_host<T>(file.take(sizeof(T)));
     }
 
     template<>
@@ -460,6 +551,14 @@ namespace my_remux::mp4
         return x;
     }
 
+    template<typename T>
+    inline T read(byte_reader_t& file)
+    {
+        T x;
+        std::memcpy(&x, file.take(sizeof(x)), sizeof(x));
+        return x;
+    }
+
     template<typename T, typename output_iter_t>
     inline void copy_number(T x, output_iter_t o)
     {
@@ -468,15 +567,25 @@ namespace my_remux::mp4
         std::copy(p, p + sizeof(T), o);
     }
 
+    using game_on::reserve_more;
+
     template<typename T>
     inline void put_number(T x, std::vector<char>& v)
     {
-        copy_number(x, std::back_inserter(v));
+        x = to_host(x);
+        auto p = reinterpret_cast<const char*>(&x);
+        v.insert(v.end(), p, p + sizeof(T));
     }
 
     inline void put_fourcc(const char* type, std::vector<char>& v)
     {
-        std::copy(type, type + 4, std::back_inserter(v));
+        v.insert(v.end(), type, type + 4);
+    }
+
+    inline void put_fourcc(fourcc_t type, std::vector<char>& v)
+    {
+        for (size_t i = 0; i < 4; ++i)
+            v.push_back(char(type.byte(i)));
     }
 
     inline void put_fullbox_header(fullbox_header_t h, std::vector<char>& v)
@@ -508,7 +617,13 @@ namespace my_remux::mp4
         return file.tellg();
     }
 
-    inline Box readSimpleBoxAtOffset(std::istream& file, size_t offset, size_t lengthFieldSize)
+    inline size_t fileLength(const byte_reader_t& file)
+    {
+        return file.size();
+    }
+
+    template<typename stream_t>
+    inline Box readSimpleBoxAtOffset(stream_t& file, size_t offset, size_t lengthFieldSize)
     {
         file.seekg(offset);
         size_t content_length;
@@ -521,14 +636,16 @@ namespace my_remux::mp4
         return Box{offset + lengthFieldSize, content_length, lengthFieldSize};
     }
 
-    inline NALU readNALUAtOffset(std::istream& file, size_t offset, size_t lengthFieldSize, game_on::nalu_kind_t kind)
+    template<typename stream_t>
+    inline NALU readNALUAtOffset(stream_t& file, size_t offset, size_t lengthFieldSize, game_on::nalu_kind_t kind)
     {
         Box box = readSimpleBoxAtOffset(file, offset, lengthFieldSize);
         uint8_t flags = file.get();
         return NALU(box, flags, kind);
     }
 
-    inline std::vector<char> readBox(std::istream& file, const Box& box)
+    template<typename stream_t>
+    inline std::vector<char> readBox(stream_t& file, const Box& box)
     {
         std::vector<char> data(box.totalLength());
         file.seekg(box.headerOffset());
@@ -536,7 +653,8 @@ namespace my_remux::mp4
         return data;
     }
 
-    inline std::vector<char> readBoxContent(std::istream& file, const Box& box)
+    template<typename stream_t>
+    inline std::vector<char> readBoxContent(stream_t& file, const Box& box)
     {
         std::vector<char> data(box.content_length);
         file.seekg(box.content_offset);
@@ -544,25 +662,45 @@ namespace my_remux::mp4
         return data;
     }
 
-    inline MP4Atom readAtomAtOffset(std::istream& file, size_t offset)
+    // the atom at offset inside a parent ending at end. size 0 means the
+    // atom extends to end (iso 14496-12 4.2). atoms smaller than their
+    // header or running past end throw, so loops over children always
+    // advance and stay inside their parent.
+    template<typename stream_t>
+    inline MP4Atom readAtomAtOffset(stream_t& file, size_t offset, size_t end)
     {
+        if (offset > end || end - offset < 8)
+            throw std::runtime_error{"atom header exceeds its parent"};
         file.seekg(offset);
-        uint32_t length = read_to_host<uint32_t>(file);
+        uint64_t length = read_to_host<uint32_t>(file);
         uint32_t type = read<uint32_t>(file);
+        size_t header_length = 8;
         if (length == 1)
         {
-            uint64_t length = read_to_host<uint64_t>(file);
-            size_t content_offset = offset + 16;
-            return MP4Atom(content_offset, length - 16, 16, type);
+            if (end - offset < 16)
+                throw std::runtime_error{"atom header exceeds its parent"};
+            length = read_to_host<uint64_t>(file);
+            header_length = 16;
         }
-        else
+        else if (length == 0)
         {
-            size_t content_offset = offset + 8;
-            return MP4Atom(content_offset, length - 8, 8, type);
+            length = end - offset;
         }
+        if (length < header_length || length > end - offset)
+            throw std::runtime_error{"atom '" + MP4Atom(0, 0, 0, type).typeString() + "' exceeds its parent"};
+        return MP4Atom(offset + header_length, size_t(length - header_length), header_length, type);
+    }
+
+    // an atom whose parent's end isn't known; size 0 reaches as far as
+    // offsets do, callers that know the end of the file resolve it
+    template<typename stream_t>
+    inline MP4Atom readAtomAtOffset(stream_t& file, size_t offset)
+    {
+        return readAtomAtOffset(file, offset, SIZE_MAX);
     }
 
-    inline fullbox_header_t read_fullbox_header(std::istream& file)
+    template<typename stream_t>
+    inline fullbox_header_t read_fullbox_header(stream_t& file)
     {
         uint8_t bytes[4] = {
             read<uint8_t>(file),
@@ -577,79 +715,140 @@ namespace my_remux::mp4
         return header;
     }
 
-    inline std::vector<int32_t> read_tts(std::istream& file, const MP4Atom& atom)
+    inline void decode_be(const void* src, uint32_t* dst, size_t n)
     {
-        std::vector<int32_t> tts;
+        decode_be32(src, dst, n);
+    }
+
+    inline void decode_be(const void* src, uint64_t* dst, size_t n)
+    {
+        decode_be64(src, dst, n);
+    }
+
+    // reads a table of n big endian words into dst in one go
+    template<typename stream_t, typename T>
+    inline void read_be_table(stream_t& file, T* dst, size_t n)
+    {
+        file.read(reinterpret_cast<char*>(dst), n * sizeof(T));
+        decode_be(dst, dst, n);
+    }
+
+    // in memory we can skip the copy and decode straight from the source
+    template<typename T>
+    inline void read_be_table(byte_reader_t& file, T* dst, size_t n)
+    {
+        decode_be(file.take(n * sizeof(T)), dst, n);
+    }
+
+    // entry count of a table atom, checked against the atom's content before
+    // anything is allocated for it. header_size is the content in front of
+    // the entries, i.e. the fullbox header and the count fields.
+    inline uint32_t checked_entry_count(uint32_t entry_count, const MP4Atom& atom, size_t header_size, size_t entry_size)
+    {
+        if (atom.content_length < header_size || (atom.content_length - header_size) / entry_size < entry_count)
+            throw std::runtime_error{"'" + atom.typeString() + "' atom too short for its entry count"};
+        return entry_count;
+    }
+
+    // reads the (count, value) pairs shared by stts and ctts
+    template<typename stream_t>
+    inline std::vector<tts_t> read_tts_entries(stream_t& file, const MP4Atom& atom)
+    {
+        static_assert(sizeof(tts_t) == 2 * sizeof(uint32_t));
         file.seekg(atom.content_offset + 4);
-        auto entry_count = read_to_host<uint32_t>(file);
-        for (int32_t i = 0; i < entry_count; ++i)
-        {
-            auto sample_count = read_to_host<int32_t>(file);
-            auto sample_value = read_to_host<int32_t>(file);
-            for (int32_t j = 0; j < sample_count; ++j)
-                tts.push_back(sample_value);
-        }
+        auto entry_count = checked_entry_count(read_to_host<uint32_t>(file), atom, 8, sizeof(tts_t));
+        std::vector<tts_t> entries(entry_count);
+        read_be_table(file, reinterpret_cast<uint32_t*>(entries.data()), 2 * size_t(entry_count));
+        return entries;
+    }
+
+    template<typename stream_t>
+    inline std::vector<int32_t> read_tts(stream_t& file, const MP4Atom& atom)
+    {
+        auto entries = read_tts_entries(file, atom);
+        size_t sample_count = 0;
+        for (auto&& entry : entries)
+            sample_count += entry.count;
+        std::vector<int32_t> tts;
+        tts.reserve(sample_count);
+        for (auto&& entry : entries)
+            tts.insert(tts.end(), entry.count, entry.duration);
         return tts;
     }
 
-    inline std::vector<uint32_t> read_stco(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline std::vector<uint32_t> read_stco(stream_t& file, const MP4Atom& atom)
     {
-        std::vector<uint32_t> stco;
         file.seekg(atom.content_offset + 4);
-        auto entry_count = read_to_host<uint32_t>(file);        
-        for (int32_t i = 0; i < entry_count; ++i)
-            stco.push_back(read_to_host<uint32_t>(file));
+        auto entry_count = checked_entry_count(read_to_host<uint32_t>(file), atom, 8, sizeof(uint32_t));
+        std::vector<uint32_t> stco(entry_count);
+        read_be_table(file, stco.data(), stco.size());
         return stco;
     }
 
-    inline std::vector<uint64_t> read_co64(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline std::vector<uint64_t> read_co64(stream_t& file, const MP4Atom& atom)
     {
-        std::vector<uint64_t> co64;
         file.seekg(atom.content_offset + 4);
-        auto entry_count = read_to_host<uint32_t>(file);        
-        for (int32_t i = 0; i < entry_count; ++i)
-            co64.push_back(read_to_host<uint64_t>(file));
+        auto entry_count = checked_entry_count(read_to_host<uint32_t>(file), atom, 8, sizeof(uint64_t));
+        std::vector<uint64_t> co64(entry_count);
+        read_be_table(file, co64.data(), co64.size());
         return co64;
     }
 
-    inline std::vector<stc_t> read_stsc(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline std::vector<stc_t> read_stsc(stream_t& file, const MP4Atom& atom)
     {
-        std::vector<stc_t> stsc;
+        static_assert(sizeof(stc_t) == 3 * sizeof(uint32_t));
         file.seekg(atom.content_offset + 4);
-        auto entry_count = read_to_host<uint32_t>(file);
-        for (int32_t i = 0; i < entry_count; ++i)
-        {
-            stsc.push_back({
-                read_to_host<uint32_t>(file),
-                read_to_host<uint32_t>(file),
-                read_to_host<uint32_t>(file)
-            });
-        }
+        auto entry_count = checked_entry_count(read_to_host<uint32_t>(file), atom, 8, sizeof(stc_t));
+        std::vector<stc_t> stsc(entry_count);
+        read_be_table(file, reinterpret_cast<uint32_t*>(stsc.data()), 3 * size_t(entry_count));
         return stsc;
     }
 
 
-    inline std::vector<int32_t> read_stts(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline tts_table_t read_stts(stream_t& file, const MP4Atom& atom)
     {
-        return read_tts(file, atom);
+        return read_tts_entries(file, atom);
     }
 
-    inline std::vector<uint32_t> read_stsz(std::istream& file, const MP4Atom& atom)
+    // a common sample size expands to entry_count sizes that aren't in the
+    // atom, so the count is capped by max_sample_count, e.g. the stts sample
+    // count, or else by the samples of that size fitting into the file
+    template<typename stream_t>
+    inline std::vector<uint32_t> read_stsz(stream_t& file, const MP4Atom& atom, std::optional<uint64_t> max_sample_count = std::nullopt)
     {
-        std::vector<uint32_t> stsz;
         file.seekg(atom.content_offset + 4);
         auto common_size = read_to_host<uint32_t>(file);
-        auto entry_count = read_to_host<int32_t>(file);
-        if (common_size == 0)
-            for (int32_t i = 0; i < entry_count; ++i)
-                stsz.push_back(read_to_host<uint32_t>(file));
-        else
-            for (int32_t i = 0; i < entry_count; ++i)
-                stsz.push_back(common_size);
+        auto entry_count = read_to_host<uint32_t>(file);
+        if (common_size != 0)
+        {
+            auto limit = max_sample_count ? *max_sample_count : fileLength(file) / common_size;
+            if (entry_count > limit)
+                throw std::runtime_error{"stsz sample count exceeds the track"};
+            return std::vector<uint32_t>(entry_count, common_size);
+        }
+        entry_count = checked_entry_count(entry_count, atom, 12, sizeof(uint32_t));
+        std::vector<uint32_t> stsz(entry_count);
+        read_be_table(file, stsz.data(), stsz.size());
         return stsz;
     }
 
-    inline std::vector<edit_t> read_elst(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline stss_t read_stss(stream_t& file, const MP4Atom& atom)
+    {
+        file.seekg(atom.content_offset + 4);
+        auto entry_count = checked_entry_count(read_to_host<uint32_t>(file), atom, 8, sizeof(uint32_t));
+        stss_t stss;
+        stss.keyframe_indices.resize(entry_count);
+        read_be_table(file, stss.keyframe_indices.data(), entry_count);
+        return stss;
+    }
+
+    template<typename stream_t>
+    inline std::vector<edit_t> read_elst(stream_t& file, const MP4Atom& atom)
     {
         std::vector<edit_t> edits;
         file.seekg(atom.content_offset);
@@ -660,7 +859,8 @@ namespace my_remux::mp4
             if (header.version == 0)
                 edits.push_back({
                     read_to_host<uint32_t>(file),
-                    read_to_host<uint32_t>(file),
+                    // signed, -1 marks an empty edit
+                    uint64_t(int64_t(read_to_host<int32_t>(file))),
                     fixed_point_t<0x10000, int32_t>::with_count(read_to_host<uint32_t>(file))
                 });
             else
@@ -672,15 +872,17 @@ namespace my_remux::mp4
         return edits;
     }
 
-    inline std::vector<int32_t> read_ctts(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline tts_table_t read_ctts(stream_t& file, const MP4Atom& atom)
     {
-        return read_tts(file, atom);
+        return read_tts_entries(file, atom);
     }
 
-    inline avcC_t read_avcC(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline avcC_t read_avcC(stream_t& file, const MP4Atom& atom)
     {
         file.seekg(atom.content_offset + 4);
-        auto naluLengthFieldSize = file.get() & 3 + 1;
+        auto naluLengthFieldSize = (file.get() & 3) + 1;
         file.seekg(atom.content_offset + 5);
         size_t elementCount = file.get() & 0x1f;
         BOOST_ASSERT(elementCount == 1);
@@ -699,7 +901,262 @@ namespace my_remux::mp4
         };
     }
 
-    inline mvhd_t read_mvhd(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline hvcC_t read_hvcC(stream_t& file, const MP4Atom& atom)
+    {
+        file.seekg(atom.content_offset);
+        hvcC_t hvcC;
+        read<uint8_t>(file); // configuration version
+        auto profile = read<uint8_t>(file);
+        hvcC.general_profile_space = profile >> 6;
+        hvcC.general_tier_flag = (profile >> 5) & 1;
+        hvcC.general_profile_idc = profile & 0x1f;
+        hvcC.general_profile_compatibility_flags = read_to_host<uint32_t>(file);
+        uint64_t constraints_hi = read_to_host<uint16_t>(file);
+        uint64_t constraints_lo = read_to_host<uint32_t>(file);
+        hvcC.general_constraint_indicator_flags = (constraints_hi << 32) | constraints_lo;
+        hvcC.general_level_idc = read<uint8_t>(file);
+        hvcC.min_spatial_segmentation_idc = read_to_host<uint16_t>(file) & 0x0fff;
+        hvcC.parallelism_type = read<uint8_t>(file) & 0x3;
+        hvcC.chroma_format_idc = read<uint8_t>(file) & 0x3;
+        hvcC.bit_depth_luma_minus8 = read<uint8_t>(file) & 0x7;
+        hvcC.bit_depth_chroma_minus8 = read<uint8_t>(file) & 0x7;
+        hvcC.avg_frame_rate = read_to_host<uint16_t>(file);
+        auto flags = read<uint8_t>(file);
+        hvcC.constant_frame_rate = flags >> 6;
+        hvcC.num_temporal_layers = (flags >> 3) & 0x7;
+        hvcC.temporal_id_nested = (flags >> 2) & 1;
+        hvcC.naluLengthFieldSize = (flags & 0x3) + 1;
+        auto array_count = read<uint8_t>(file);
+        for (uint8_t i = 0; i < array_count; ++i)
+        {
+            hvcC_t::array_t array;
+            auto type = read<uint8_t>(file);
+            array.array_completeness = type >> 7;
+            array.nal_unit_type = type & 0x3f;
+            auto nalu_count = read_to_host<uint16_t>(file);
+            for (uint16_t j = 0; j < nalu_count; ++j)
+            {
+                std::vector<char> nalu(read_to_host<uint16_t>(file));
+                file.read(nalu.data(), nalu.size());
+                array.nalus.push_back(std::move(nalu));
+            }
+            hvcC.arrays.push_back(std::move(array));
+        }
+        if (size_t(file.tellg()) > atom.endOffset())
+            throw std::runtime_error{"hvcC atom too short"};
+        return hvcC;
+    }
+
+    // calls f(child_atom) for the atoms following the fixed fields of a
+    // visual sample entry
+    template<typename stream_t, typename F>
+    inline void for_each_sample_entry_child(stream_t& file, const MP4Atom& entry, F&& f)
+    {
+        auto offset = entry.content_offset + entry.childOffset();
+        while (offset + 8 <= entry.endOffset())
+        {
+            auto child = readAtomAtOffset(file, offset, entry.endOffset());
+            f(child);
+            offset = child.endOffset();
+        }
+    }
+
+    // reads avc1, hvc1 and hev1 entries, which share the visual sample entry layout
+    template<typename entry_t, typename stream_t, typename config_reader_t>
+    inline entry_t read_visual_sample_entry(stream_t& file, const MP4Atom& atom, fourcc_t config_type, config_reader_t read_config)
+    {
+        entry_t entry;
+        file.seekg(atom.content_offset + 24);
+        entry.width = read_to_host<uint16_t>(file);
+        entry.height = read_to_host<uint16_t>(file);
+        bool found = false;
+        for_each_sample_entry_child(file, atom, [&](const MP4Atom& child) {
+            if (!found && child.isType(config_type))
+            {
+                read_config(entry, child);
+                found = true;
+            }
+        });
+        if (!found)
+            throw std::runtime_error{"sample entry '" + atom.typeString() + "' without '" + config_type.str() + "' atom"};
+        return entry;
+    }
+
+    template<typename stream_t>
+    inline avc1_t read_avc1(stream_t& file, const MP4Atom& atom)
+    {
+        return read_visual_sample_entry<avc1_t>(file, atom, "avcC", [&](avc1_t& entry, const MP4Atom& child) {
+            entry.avcC = read_avcC(file, child);
+        });
+    }
+
+    template<typename stream_t>
+    inline hvc1_t read_hvc1(stream_t& file, const MP4Atom& atom)
+    {
+        return read_visual_sample_entry<hvc1_t>(file, atom, "hvcC", [&](hvc1_t& entry, const MP4Atom& child) {
+            entry.hvcC = read_hvcC(file, child);
+        });
+    }
+
+    template<typename stream_t>
+    inline hev1_t read_hev1(stream_t& file, const MP4Atom& atom)
+    {
+        return read_visual_sample_entry<hev1_t>(file, atom, "hvcC", [&](hev1_t& entry, const MP4Atom& child) {
+            entry.hvcC = read_hvcC(file, child);
+        });
+    }
+
+    namespace detail
+    {
+        // mpeg-4 descriptor header: tag and a size of up to four 7 bit groups
+        template<typename stream_t>
+        inline std::pair<uint8_t, uint32_t> read_descriptor_header(stream_t& file)
+        {
+            auto tag = read<uint8_t>(file);
+            uint32_t size = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                auto b = read<uint8_t>(file);
+                size = (size << 7) | (b & 0x7f);
+                if (!(b & 0x80))
+                    break;
+            }
+            return {tag, size};
+        }
+    }
+
+    template<typename stream_t>
+    inline esds_t read_esds(stream_t& file, const MP4Atom& atom)
+    {
+        esds_t esds;
+        file.seekg(atom.content_offset);
+        read_fullbox_header(file);
+        auto [es_tag, es_size] = detail::read_descriptor_header(file);
+        if (es_tag != 0x03)
+            throw std::runtime_error{"esds without ES_Descriptor"};
+        esds.es_id = read_to_host<uint16_t>(file);
+        auto flags = read<uint8_t>(file);
+        if (flags & 0x80) // streamDependenceFlag
+            read_to_host<uint16_t>(file);
+        if (flags & 0x40) // URL_Flag
+        {
+            auto url_length = read<uint8_t>(file);
+            file.seekg(size_t(file.tellg()) + url_length);
+        }
+        if (flags & 0x20) // OCRstreamFlag
+            read_to_host<uint16_t>(file);
+        auto [config_tag, config_size] = detail::read_descriptor_header(file);
+        if (config_tag != 0x04)
+            throw std::runtime_error{"esds without DecoderConfigDescriptor"};
+        auto config_end = size_t(file.tellg()) + config_size;
+        esds.object_type_indication = read<uint8_t>(file);
+        esds.stream_type = read<uint8_t>(file) >> 2;
+        esds.buffer_size = (uint32_t(read<uint8_t>(file)) << 16) | read_to_host<uint16_t>(file);
+        esds.max_bitrate = read_to_host<uint32_t>(file);
+        esds.avg_bitrate = read_to_host<uint32_t>(file);
+        if (size_t(file.tellg()) < config_end)
+        {
+            auto [info_tag, info_size] = detail::read_descriptor_header(file);
+            if (info_tag == 0x05)
+            {
+                esds.decoder_specific_info.resize(info_size);
+                file.read(esds.decoder_specific_info.data(), info_size);
+            }
+        }
+        if (size_t(file.tellg()) > atom.endOffset() || config_end > atom.endOffset())
+            throw std::runtime_error{"esds atom too short"};
+        return esds;
+    }
+
+    template<typename stream_t>
+    inline mp4a_t read_mp4a(stream_t& file, const MP4Atom& atom)
+    {
+        mp4a_t mp4a;
+        file.seekg(atom.content_offset + 16);
+        mp4a.channel_count = read_to_host<uint16_t>(file);
+        mp4a.sample_size = read_to_host<uint16_t>(file);
+        file.seekg(atom.content_offset + 24);
+        mp4a.sample_rate = read_to_host<uint32_t>(file) >> 16;
+        bool found = false;
+        for_each_sample_entry_child(file, atom, [&](const MP4Atom& child) {
+            if (!found && child.isType("esds"))
+            {
+                mp4a.esds = read_esds(file, child);
+                found = true;
+            }
+        });
+        if (!found)
+            throw std::runtime_error{"sample entry 'mp4a' without 'esds' atom"};
+        return mp4a;
+    }
+
+    // reads the first sample entry of stsd
+    template<typename stream_t>
+    inline stsd_t read_stsd(stream_t& file, const MP4Atom& atom)
+    {
+        auto entry = readAtomAtOffset(file, atom.content_offset + atom.childOffset(), atom.endOffset());
+        if (entry.isType("avc1"))
+            return stsd_t{read_avc1(file, entry)};
+        if (entry.isType("hvc1"))
+            return stsd_t{read_hvc1(file, entry)};
+        if (entry.isType("hev1"))
+            return stsd_t{read_hev1(file, entry)};
+        if (entry.isType("mp4a"))
+            return stsd_t{read_mp4a(file, entry)};
+        throw std::runtime_error{"unsupported sample entry '" + entry.typeString() + "'"};
+    }
+
+    // sample entry for an h.264 track, with the picture size taken from the sps
+    inline avc1_t make_avc1(std::vector<char> sps, std::vector<char> pps, int naluLengthFieldSize = 4)
+    {
+        auto parsed = game_on::parse_h264_sps(sps.data(), sps.size());
+        avc1_t avc1;
+        avc1.width = uint16_t(parsed.width);
+        avc1.height = uint16_t(parsed.height);
+        avc1.avcC.naluLengthFieldSize = naluLengthFieldSize;
+        avc1.avcC.sps = std::move(sps);
+        avc1.avcC.pps = std::move(pps);
+        return avc1;
+    }
+
+    // hvcC for an h.265 track, with profile, level and format taken from the sps
+    inline hvcC_t make_hvcC(std::vector<char> vps, std::vector<char> sps, std::vector<char> pps, int naluLengthFieldSize = 4)
+    {
+        auto parsed = game_on::parse_h265_sps(sps.data(), sps.size());
+        hvcC_t hvcC;
+        hvcC.general_profile_space = parsed.general_profile_space;
+        hvcC.general_tier_flag = parsed.general_tier_flag;
+        hvcC.general_profile_idc = parsed.general_profile_idc;
+        hvcC.general_profile_compatibility_flags = parsed.general_profile_compatibility_flags;
+        hvcC.general_constraint_indicator_flags = parsed.general_constraint_indicator_flags;
+        hvcC.general_level_idc = parsed.general_level_idc;
+        hvcC.chroma_format_idc = uint8_t(parsed.chroma_format_idc);
+        hvcC.bit_depth_luma_minus8 = uint8_t(parsed.bit_depth_luma - 8);
+        hvcC.bit_depth_chroma_minus8 = uint8_t(parsed.bit_depth_chroma - 8);
+        hvcC.num_temporal_layers = parsed.max_sub_layers;
+        hvcC.temporal_id_nested = parsed.temporal_id_nesting;
+        hvcC.naluLengthFieldSize = naluLengthFieldSize;
+        hvcC.arrays = {
+            {true, 32, {std::move(vps)}},
+            {true, 33, {std::move(sps)}},
+            {true, 34, {std::move(pps)}},
+        };
+        return hvcC;
+    }
+
+    inline hvc1_t make_hvc1(std::vector<char> vps, std::vector<char> sps, std::vector<char> pps, int naluLengthFieldSize = 4)
+    {
+        auto parsed = game_on::parse_h265_sps(sps.data(), sps.size());
+        hvc1_t hvc1;
+        hvc1.width = uint16_t(parsed.width);
+        hvc1.height = uint16_t(parsed.height);
+        hvc1.hvcC = make_hvcC(std::move(vps), std::move(sps), std::move(pps), naluLengthFieldSize);
+        return hvc1;
+    }
+
+    template<typename stream_t>
+    inline mvhd_t read_mvhd(stream_t& file, const MP4Atom& atom)
     {
         mvhd_t mvhd;
         file.seekg(atom.content_offset);
@@ -730,7 +1187,37 @@ namespace my_remux::mp4
         return mvhd;
     }
 
-    inline mdhd_t read_mdhd(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline tkhd_t read_tkhd(stream_t& file, const MP4Atom& atom)
+    {
+        tkhd_t tkhd;
+        file.seekg(atom.content_offset);
+        auto header = read_fullbox_header(file);
+        if (header.version == 0)
+        {
+            tkhd.creation_time = read_to_host<uint32_t>(file);
+            tkhd.modification_time = read_to_host<uint32_t>(file);
+            tkhd.track_id = read_to_host<uint32_t>(file);
+            read_to_host<uint32_t>(file); // reserved
+            tkhd.duration = read_to_host<uint32_t>(file);
+        }
+        else
+        {
+            tkhd.creation_time = read_to_host<uint64_t>(file);
+            tkhd.modification_time = read_to_host<uint64_t>(file);
+            tkhd.track_id = read_to_host<uint32_t>(file);
+            read_to_host<uint32_t>(file); // reserved
+            tkhd.duration = read_to_host<uint64_t>(file);
+        }
+        read_to_host<uint64_t>(file); // reserved
+        read_to_host<uint16_t>(file); // layer
+        tkhd.group = read_to_host<uint16_t>(file);
+        tkhd.volume = read_to_host<uint16_t>(file);
+        return tkhd;
+    }
+
+    template<typename stream_t>
+    inline mdhd_t read_mdhd(stream_t& file, const MP4Atom& atom)
     {
         mdhd_t mdhd;
         file.seekg(atom.content_offset);
@@ -753,7 +1240,28 @@ namespace my_remux::mp4
         return mdhd;
     }
 
-    inline mfhd_t read_mfhd(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline hdlr_t read_hdlr(stream_t& file, const MP4Atom& atom)
+    {
+        hdlr_t hdlr;
+        file.seekg(atom.content_offset);
+        read_fullbox_header(file);
+        read_to_host<uint32_t>(file); // pre_defined
+        hdlr.handler_type = fourcc_t{read<uint32_t>(file)};
+        auto name_offset = atom.content_offset + 24;
+        if (name_offset < atom.endOffset())
+        {
+            hdlr.description.resize(atom.endOffset() - name_offset);
+            file.seekg(name_offset);
+            file.read(hdlr.description.data(), hdlr.description.size());
+            // null terminated, but some writers use pascal strings
+            hdlr.description.resize(std::strlen(hdlr.description.c_str()));
+        }
+        return hdlr;
+    }
+
+    template<typename stream_t>
+    inline mfhd_t read_mfhd(stream_t& file, const MP4Atom& atom)
     {
         file.seekg(atom.content_offset);
         read_fullbox_header(file);
@@ -762,7 +1270,8 @@ namespace my_remux::mp4
         };
     }
 
-    inline tfdt_t read_tfdt(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline tfdt_t read_tfdt(stream_t& file, const MP4Atom& atom)
     {
         file.seekg(atom.content_offset);
         auto header = read_fullbox_header(file);
@@ -772,7 +1281,8 @@ namespace my_remux::mp4
             return tfdt_t{read_to_host<uint64_t>(file)};
     }
 
-    inline tfhd_t read_tfhd(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline tfhd_t read_tfhd(stream_t& file, const MP4Atom& atom)
     {
         file.seekg(atom.content_offset);
         auto header = read_fullbox_header(file);
@@ -789,10 +1299,12 @@ namespace my_remux::mp4
             tfhd.default_sample_size = read_to_host<uint32_t>(file);
         if (header.flags & 0x20)
             tfhd.default_sample_flags = read_to_host<uint32_t>(file);
+        tfhd.default_base_is_moof = header.flags & 0x20000;
         return tfhd;
     }
 
-    inline trun_t read_trun(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline trun_t read_trun(stream_t& file, const MP4Atom& atom)
     {
         file.seekg(atom.content_offset);
         trun_t trun;
@@ -818,16 +1330,18 @@ namespace my_remux::mp4
         return trun;
     }
 
-    inline traf_t read_traf(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline traf_t read_traf(stream_t& file, const MP4Atom& atom)
     {
-        auto tfhd_atom = readAtomAtOffset(file, atom.content_offset);
+        auto tfhd_atom = readAtomAtOffset(file, atom.content_offset, atom.endOffset());
         traf_t traf{
             read_tfhd(file, tfhd_atom),
         };
         auto offset = tfhd_atom.endOffset();
-        while (offset < atom.endOffset())
+        auto end = atom.endOffset();
+        while (offset < end)
         {
-            auto atom = readAtomAtOffset(file, offset);
+            auto atom = readAtomAtOffset(file, offset, end);
             if (atom.isType("tfdt"))
             {
                 if (traf.tfdt)
@@ -845,16 +1359,18 @@ namespace my_remux::mp4
         return traf;
     }
 
-    inline moof_t read_moof(std::istream& file, const MP4Atom& atom)
+    template<typename stream_t>
+    inline moof_t read_moof(stream_t& file, const MP4Atom& atom)
     {
-        auto mfhd_atom = readAtomAtOffset(file, atom.content_offset);
+        auto mfhd_atom = readAtomAtOffset(file, atom.content_offset, atom.endOffset());
         moof_t moof{
             read_mfhd(file, mfhd_atom),
         };
         auto offset = mfhd_atom.endOffset();
-        while (offset < atom.endOffset())
+        auto end = atom.endOffset();
+        while (offset < end)
         {
-            auto atom = readAtomAtOffset(file, offset);
+            auto atom = readAtomAtOffset(file, offset, end);
             if (atom.isType("traf"))
                 moof.traf.push_back(read_traf(file, atom));
             else
@@ -866,26 +1382,533 @@ namespace my_remux::mp4
         return moof;
     }
 
-    inline void write_matrix(std::vector<char>& out, const matrix_t& matrix)
+    template<typename stream_t>
+    inline stbl_t read_stbl(stream_t& file, const MP4Atom& atom)
     {
-        put_number(matrix.a.count(), out);
-        put_number(matrix.b.count(), out);
-        put_number(matrix.u.count(), out);
-        put_number(matrix.c.count(), out);
-        put_number(matrix.d.count(), out);
-        put_number(matrix.v.count(), out);
-        put_number(matrix.tx.count(), out);
-        put_number(matrix.ty.count(), out);
-        put_number(matrix.w.count(), out);
+        stbl_t stbl;
+        bool has_stsd = false;
+        std::optional<MP4Atom> stsz; // read last, capped by the stts sample count
+        auto offset = atom.content_offset;
+        auto end = atom.endOffset();
+        while (offset < end)
+        {
+            auto atom = readAtomAtOffset(file, offset, end);
+            if (atom.isType("stsd"))
+            {
+                stbl.stsd = read_stsd(file, atom);
+                has_stsd = true;
+            }
+            else if (atom.isType("stts"))
+            {
+                stbl.stts = read_stts(file, atom);
+            }
+            else if (atom.isType("ctts"))
+            {
+                stbl.ctts = read_ctts(file, atom);
+            }
+            else if (atom.isType("stss"))
+            {
+                stbl.stss = read_stss(file, atom);
+            }
+            else if (atom.isType("stsc"))
+            {
+                stbl.stsc = read_stsc(file, atom);
+            }
+            else if (atom.isType("stsz"))
+            {
+                stsz = atom;
+            }
+            else if (atom.isType("co64"))
+            {
+                stbl.co64 = read_co64(file, atom);
+            }
+            else if (atom.isType("stco"))
+            {
+                auto stco = read_stco(file, atom);
+                stbl.co64.assign(stco.begin(), stco.end());
+            }
+            offset = atom.endOffset();
+        }
+        if (!has_stsd)
+            throw std::runtime_error{"stbl without stsd atom"};
+        if (stsz)
+            stbl.stsz = read_stsz(file, *stsz, stbl.stts.sample_count());
+        return stbl;
     }
 
-    inline size_t write_avcC(std::vector<char>& out, const avcC_t& avcc)
+    template<typename stream_t>
+    inline minf_t read_minf(stream_t& file, const MP4Atom& atom)
     {
-        auto start_offset = begin_atom(out, "avcC");
-        out.push_back(0x1); // version
-        out.push_back(avcc.sps[1]); // profile
-        out.push_back(avcc.sps[2]); // constraints
-        out.push_back(avcc.sps[3]); // level
+        minf_t minf;
+        bool has_stbl = false;
+        auto offset = atom.content_offset;
+        auto end = atom.endOffset();
+        while (offset < end)
+        {
+            auto atom = readAtomAtOffset(file, offset, end);
+            // the media headers carry nothing we keep besides their type
+            if (atom.isType("vmhd"))
+            {
+                minf.media_header = vmhd_t{};
+            }
+            else if (atom.isType("smhd"))
+            {
+                minf.media_header = smhd_t{};
+            }
+            else if (atom.isType("nmhd"))
+            {
+                minf.media_header = nmhd_t{};
+            }
+            else if (atom.isType("stbl"))
+            {
+                minf.stbl = read_stbl(file, atom);
+                has_stbl = true;
+            }
+            offset = atom.endOffset();
+        }
+        if (!has_stbl)
+            throw std::runtime_error{"minf without stbl atom"};
+        return minf;
+    }
+
+    template<typename stream_t>
+    inline mdia_t read_mdia(stream_t& file, const MP4Atom& atom)
+    {
+        mdia_t mdia;
+        bool has_mdhd = false;
+        bool has_minf = false;
+        auto offset = atom.content_offset;
+        auto end = atom.endOffset();
+        while (offset < end)
+        {
+            auto atom = readAtomAtOffset(file, offset, end);
+            if (atom.isType("mdhd"))
+            {
+                mdia.mdhd = read_mdhd(file, atom);
+                has_mdhd = true;
+            }
+            else if (atom.isType("hdlr"))
+            {
+                mdia.hdlr = read_hdlr(file, atom);
+            }
+            else if (atom.isType("minf"))
+            {
+                mdia.minf = read_minf(file, atom);
+                has_minf = true;
+            }
+            offset = atom.endOffset();
+        }
+        if (!has_mdhd || !has_minf)
+            throw std::runtime_error{"mdia without mdhd or minf atom"};
+        return mdia;
+    }
+
+    template<typename stream_t>
+    inline trak_t read_trak(stream_t& file, const MP4Atom& atom)
+    {
+        trak_t trak;
+        bool has_tkhd = false;
+        bool has_mdia = false;
+        auto offset = atom.content_offset;
+        auto end = atom.endOffset();
+        while (offset < end)
+        {
+            auto atom = readAtomAtOffset(file, offset, end);
+            if (atom.isType("tkhd"))
+            {
+                trak.tkhd = read_tkhd(file, atom);
+                has_tkhd = true;
+            }
+            else if (atom.isType("edts"))
+            {
+                auto elst = readAtomAtOffset(file, atom.content_offset, atom.endOffset());
+                if (elst.isType("elst"))
+                    trak.edts.elst = read_elst(file, elst);
+            }
+            else if (atom.isType("mdia"))
+            {
+                trak.mdia = read_mdia(file, atom);
+                has_mdia = true;
+            }
+            offset = atom.endOffset();
+        }
+        if (!has_tkhd || !has_mdia)
+            throw std::runtime_error{"trak without tkhd or mdia atom"};
+        return trak;
+    }
+
+    // reads the parts of moov this library models; unknown atoms such as
+    // udta are skipped
+    template<typename stream_t>
+    inline moov_t read_moov(stream_t& file, const MP4Atom& atom)
+    {
+        moov_t moov;
+        bool has_mvhd = false;
+        auto offset = atom.content_offset;
+        auto end = atom.endOffset();
+        while (offset < end)
+        {
+            auto atom = readAtomAtOffset(file, offset, end);
+            if (atom.isType("mvhd"))
+            {
+                moov.mvhd = read_mvhd(file, atom);
+                has_mvhd = true;
+            }
+            else if (atom.isType("trak"))
+            {
+                moov.traks.push_back(read_trak(file, atom));
+            }
+            offset = atom.endOffset();
+        }
+        if (!has_mvhd)
+            throw std::runtime_error{"moov without mvhd atom"};
+        return moov;
+    }
+
+    // parses atom with the reader registered for its type in box_types
+    // and passes the result to f. returns false for types without a reader.
+    template<typename stream_t, typename visitor_t>
+    inline bool parse_atom(stream_t& file, const MP4Atom& atom, visitor_t&& f)
+    {
+        auto info = atom.typeInfo();
+        switch (info ? info->parser : box_parser_t::none)
+        {
+        case box_parser_t::none: return false;
+        case box_parser_t::mvhd: f(read_mvhd(file, atom)); return true;
+        case box_parser_t::tkhd: f(read_tkhd(file, atom)); return true;
+        case box_parser_t::mdhd: f(read_mdhd(file, atom)); return true;
+        case box_parser_t::elst: f(read_elst(file, atom)); return true;
+        case box_parser_t::stts: f(read_stts(file, atom)); return true;
+        case box_parser_t::ctts: f(read_ctts(file, atom)); return true;
+        case box_parser_t::stss: f(read_stss(file, atom)); return true;
+        case box_parser_t::stsc: f(read_stsc(file, atom)); return true;
+        case box_parser_t::stsz: f(read_stsz(file, atom)); return true;
+        case box_parser_t::stco: f(read_stco(file, atom)); return true;
+        case box_parser_t::co64: f(read_co64(file, atom)); return true;
+        case box_parser_t::avcC: f(read_avcC(file, atom)); return true;
+        case box_parser_t::hvcC: f(read_hvcC(file, atom)); return true;
+        case box_parser_t::esds: f(read_esds(file, atom)); return true;
+        case box_parser_t::hdlr: f(read_hdlr(file, atom)); return true;
+        case box_parser_t::mfhd: f(read_mfhd(file, atom)); return true;
+        case box_parser_t::tfhd: f(read_tfhd(file, atom)); return true;
+        case box_parser_t::tfdt: f(read_tfdt(file, atom)); return true;
+        case box_parser_t::trun: f(read_trun(file, atom)); return true;
+        }
+        return false;
+    }
+
+    // ---------------------- box size computation --------------------------
+    // size_of_* returns the exact number of bytes the matching write_* will
+    // produce, so the output can be reserved once up front.
+
+    constexpr size_t atom_header_size = 8;
+    constexpr size_t fullbox_header_size = atom_header_size + 4;
+
+    inline size_t size_of_avcC(const avcC_t& avcc)
+    {
+        return atom_header_size + 6 + 2 + avcc.sps.size() + 1 + 2 + avcc.pps.size();
+    }
+
+    inline size_t size_of_avc1(const avc1_t& avc1)
+    {
+        return atom_header_size + 78 + size_of_avcC(avc1.avcC);
+    }
+
+    inline size_t size_of_hvcC(const hvcC_t& hvcC)
+    {
+        size_t size = atom_header_size + 23;
+        for (auto& array : hvcC.arrays)
+        {
+            size += 3;
+            for (auto& nalu : array.nalus)
+                size += 2 + nalu.size();
+        }
+        return size;
+    }
+
+    inline size_t size_of_hvc1(const hvc1_t& hvc1)
+    {
+        return atom_header_size + 78 + size_of_hvcC(hvc1.hvcC);
+    }
+
+    inline size_t size_of_hev1(const hev1_t& hev1)
+    {
+        return atom_header_size + 78 + size_of_hvcC(hev1.hvcC);
+    }
+
+    // descriptors are written with four byte sizes
+    inline size_t size_of_esds(const esds_t& esds)
+    {
+        size_t decoder_specific_info = esds.decoder_specific_info.empty() ? 0 : 5 + esds.decoder_specific_info.size();
+        size_t decoder_config = 5 + 13 + decoder_specific_info;
+        size_t sl_config = 5 + 1;
+        return fullbox_header_size + 5 + 3 + decoder_config + sl_config;
+    }
+
+    inline size_t size_of_mp4a(const mp4a_t& mp4a)
+    {
+        return atom_header_size + 28 + size_of_esds(mp4a.esds);
+    }
+
+    inline size_t size_of_sample_entry(const sample_entry_t& entry)
+    {
+        struct
+        {
+            size_t operator()(const avc1_t& e) const {return size_of_avc1(e);}
+            size_t operator()(const hvc1_t& e) const {return size_of_hvc1(e);}
+            size_t operator()(const hev1_t& e) const {return size_of_hev1(e);}
+            size_t operator()(const mp4a_t& e) const {return size_of_mp4a(e);}
+        } size_of;
+        return std::visit(size_of, entry);
+    }
+
+    inline size_t size_of_stsd(const stsd_t& stsd)
+    {
+        return fullbox_header_size + 4 + size_of_sample_entry(stsd.entry);
+    }
+
+    inline size_t size_of_tts(const std::vector<tts_t>& entries)
+    {
+        return fullbox_header_size + 4 + 8 * entries.size();
+    }
+
+    inline size_t size_of_tts(const tts_table_t& table)
+    {
+        return size_of_tts(table.runs());
+    }
+
+    inline size_t size_of_stss(const stss_t& stss)
+    {
+        return fullbox_header_size + 4 + 4 * stss.keyframe_indices.size();
+    }
+
+    inline size_t size_of_stsc(const std::vector<stc_t>& stsc)
+    {
+        return fullbox_header_size + 4 + 12 * stsc.size();
+    }
+
+    inline size_t size_of_stsz(const std::vector<uint32_t>& stsz)
+    {
+        return fullbox_header_size + 8 + 4 * stsz.size();
+    }
+
+    inline size_t size_of_co64(const std::vector<uint64_t>& co64)
+    {
+        return fullbox_header_size + 4 + 8 * co64.size();
+    }
+
+    inline size_t size_of_stco(const std::vector<uint64_t>& co64)
+    {
+        return fullbox_header_size + 4 + 4 * co64.size();
+    }
+
+    inline bool needs_co64(const std::vector<uint64_t>& co64)
+    {
+        return std::any_of(co64.begin(), co64.end(), [](uint64_t offset) {return offset > UINT32_MAX;});
+    }
+
+    inline size_t size_of_chunk_offsets(const std::vector<uint64_t>& co64)
+    {
+        return needs_co64(co64) ? size_of_co64(co64) : size_of_stco(co64);
+    }
+
+    // stss and ctts are left out when empty, as write_stbl does
+    inline size_t size_of_stbl(const stbl_t& stbl)
+    {
+        return atom_header_size +
+            size_of_stsd(stbl.stsd) +
+            size_of_tts(stbl.stts) +
+            (stbl.stss.keyframe_indices.empty() ? 0 : size_of_stss(stbl.stss)) +
+            (stbl.ctts.empty() ? 0 : size_of_tts(stbl.ctts)) +
+            size_of_stsc(stbl.stsc) +
+            size_of_stsz(stbl.stsz) +
+            size_of_chunk_offsets(stbl.co64);
+    }
+
+    inline size_t size_of_mvhd(const mvhd_t&)
+    {
+        return fullbox_header_size + 28 + 4 + 2 + 10 + 36 + 28;
+    }
+
+    inline size_t size_of_mdhd(const mdhd_t&)
+    {
+        return fullbox_header_size + 28 + 4;
+    }
+
+    inline size_t size_of_hdlr(const hdlr_t& hdlr)
+    {
+        return fullbox_header_size + 20 + hdlr.description.size() + 1;
+    }
+
+    inline size_t size_of_vmhd(const vmhd_t&)
+    {
+        return fullbox_header_size + 8;
+    }
+
+    inline size_t size_of_smhd(const smhd_t&)
+    {
+        return fullbox_header_size + 4;
+    }
+
+    inline size_t size_of_nmhd(const nmhd_t&)
+    {
+        return fullbox_header_size;
+    }
+
+    inline size_t size_of_media_header(const media_header_t& media_header)
+    {
+        struct
+        {
+            size_t operator()(const vmhd_t& h) const {return size_of_vmhd(h);}
+            size_t operator()(const smhd_t& h) const {return size_of_smhd(h);}
+            size_t operator()(const nmhd_t& h) const {return size_of_nmhd(h);}
+        } size_of;
+        return std::visit(size_of, media_header);
+    }
+
+    inline size_t size_of_url(const url_t&)
+    {
+        return fullbox_header_size;
+    }
+
+    inline size_t size_of_dref(const dref_t& dref)
+    {
+        return fullbox_header_size + 4 + size_of_url(dref.url);
+    }
+
+    inline size_t size_of_dinf(const dinf_t& dinf)
+    {
+        return atom_header_size + size_of_dref(dinf.dref);
+    }
+
+    inline size_t size_of_minf(const minf_t& minf)
+    {
+        return atom_header_size + size_of_media_header(minf.media_header) + size_of_dinf(minf.dinf) + size_of_stbl(minf.stbl);
+    }
+
+    inline size_t size_of_mdia(const mdia_t& mdia)
+    {
+        return atom_header_size + size_of_mdhd(mdia.mdhd) + size_of_hdlr(mdia.hdlr) + size_of_minf(mdia.minf);
+    }
+
+    inline size_t size_of_elst(const std::vector<edit_t>& elst)
+    {
+        return fullbox_header_size + 4 + 20 * elst.size();
+    }
+
+    inline size_t size_of_edts(const edts_t& edts)
+    {
+        return atom_header_size + size_of_elst(edts.elst);
+    }
+
+    inline size_t size_of_tkhd(const tkhd_t&)
+    {
+        return fullbox_header_size + 92;
+    }
+
+    inline size_t size_of_trak(const trak_t& trak)
+    {
+        return atom_header_size + size_of_tkhd(trak.tkhd) + size_of_edts(trak.edts) + size_of_mdia(trak.mdia);
+    }
+
+    inline size_t size_of_trex(const trex_t&)
+    {
+        return fullbox_header_size + 20;
+    }
+
+    inline size_t size_of_mvex(const mvex_t& mvex)
+    {
+        return atom_header_size + size_of_trex({}) * mvex.trex.size();
+    }
+
+    inline size_t size_of_moov(const moov_t& moov)
+    {
+        size_t size = atom_header_size + size_of_mvhd(moov.mvhd);
+        for (auto& trak : moov.traks)
+            size += size_of_trak(trak);
+        return size + (moov.mvex ? size_of_mvex(*moov.mvex) : 0);
+    }
+
+    inline size_t size_of_ftyp(const ftyp_t&)
+    {
+        return atom_header_size + 24;
+    }
+
+    inline size_t size_of_mfhd(const mfhd_t&)
+    {
+        return fullbox_header_size + 4;
+    }
+
+    inline size_t size_of_tfhd(const tfhd_t& tfhd)
+    {
+        return fullbox_header_size + 4 +
+            (tfhd.base_data_offset ? 8 : 0) +
+            (tfhd.sample_description_index ? 4 : 0) +
+            (tfhd.default_sample_duration ? 4 : 0) +
+            (tfhd.default_sample_size ? 4 : 0) +
+            (tfhd.default_sample_flags ? 4 : 0);
+    }
+
+    inline size_t size_of_tfdt(const tfdt_t&)
+    {
+        return fullbox_header_size + 8;
+    }
+
+    inline size_t size_of_trun(const trun_t& trun)
+    {
+        size_t sample_size = 0;
+        if (!trun.samples.empty())
+        {
+            auto& sample = trun.samples.front();
+            sample_size += sample.duration ? 4 : 0;
+            sample_size += sample.size ? 4 : 0;
+            sample_size += sample.flags ? 4 : 0;
+            sample_size += sample.composition_time_offset ? 4 : 0;
+        }
+        return fullbox_header_size + 4 +
+            (trun.data_offset ? 4 : 0) +
+            (trun.first_sample_flags ? 4 : 0) +
+            sample_size * trun.samples.size();
+    }
+
+    inline size_t size_of_traf(const traf_t& traf)
+    {
+        size_t size = atom_header_size + size_of_tfhd(traf.tfhd);
+        if (traf.tfdt)
+            size += size_of_tfdt(*traf.tfdt);
+        for (auto& trun : traf.trun)
+            size += size_of_trun(trun);
+        return size;
+    }
+
+    inline size_t size_of_moof(const moof_t& moof)
+    {
+        size_t size = atom_header_size + size_of_mfhd(moof.mfhd);
+        for (auto& traf : moof.traf)
+            size += size_of_traf(traf);
+        return size;
+    }
+
+    inline void write_matrix(std::vector<char>& out, const matrix_t& matrix)
+    {
+        put_number(matrix.a.count(), out);
+        put_number(matrix.b.count(), out);
+        put_number(matrix.u.count(), out);
+        put_number(matrix.c.count(), out);
+        put_number(matrix.d.count(), out);
+        put_number(matrix.v.count(), out);
+        put_number(matrix.tx.count(), out);
+        put_number(matrix.ty.count(), out);
+        put_number(matrix.w.count(), out);
+    }
+
+    inline size_t write_avcC(std::vector<char>& out, const avcC_t& avcc)
+    {
+        auto start_offset = begin_atom(out, "avcC");
+        out.push_back(0x1); // version
+        out.push_back(avcc.sps[1]); // profile
+        out.push_back(avcc.sps[2]); // constraints
+        out.push_back(avcc.sps[3]); // level
         out.push_back(avcc.naluLengthFieldSize - 1);
         out.push_back(1); // num sps nalus
         put_number(uint16_t(avcc.sps.size()), out);
@@ -896,9 +1919,9 @@ namespace my_remux::mp4
         return finish_atom(out, start_offset);
     }
 
-    inline size_t write_avc1(std::vector<char>& out, const avc1_t& avc1)
+    // fields shared by all visual sample entries, up to the codec configuration
+    inline void write_visual_sample_entry_fields(std::vector<char>& out, uint16_t width, uint16_t height)
     {
-        auto start_offset = begin_atom(out, "avc1");
         put_number(uint32_t{0}, out); // reserved
         put_number(uint16_t{0}, out); // reserved
         put_number(uint16_t{1}, out); // data reference index
@@ -907,8 +1930,8 @@ namespace my_remux::mp4
         put_number(uint32_t{0}, out); // reserved
         put_number(uint32_t{0}, out); // reserved
         put_number(uint32_t{0}, out); // reserved
-        put_number(avc1.width, out);
-        put_number(avc1.height, out);
+        put_number(width, out);
+        put_number(height, out);
         put_number(uint32_t{0x00480000}, out); // horizontal resolution: 72dpi
         put_number(uint32_t{0x00480000}, out); // vecrtical resolution: 72dpi
         put_number(uint32_t{0}, out); // data size
@@ -917,16 +1940,137 @@ namespace my_remux::mp4
             out.push_back(0); // deprecated compressor name?
         put_number(uint16_t{0x18}, out); // reserved
         put_number(uint16_t{0xffff}, out); // reserved
+    }
+
+    inline size_t write_avc1(std::vector<char>& out, const avc1_t& avc1)
+    {
+        auto start_offset = begin_atom(out, "avc1");
+        write_visual_sample_entry_fields(out, avc1.width, avc1.height);
         write_avcC(out, avc1.avcC);
         return finish_atom(out, start_offset);        
     }
 
+    inline size_t write_hvcC(std::vector<char>& out, const hvcC_t& hvcC)
+    {
+        auto start_offset = begin_atom(out, "hvcC");
+        out.push_back(0x1); // version
+        out.push_back(char((hvcC.general_profile_space << 6) | (hvcC.general_tier_flag << 5) | (hvcC.general_profile_idc & 0x1f)));
+        put_number(hvcC.general_profile_compatibility_flags, out);
+        put_number(uint16_t(hvcC.general_constraint_indicator_flags >> 32), out);
+        put_number(uint32_t(hvcC.general_constraint_indicator_flags), out);
+        out.push_back(char(hvcC.general_level_idc));
+        put_number(uint16_t(0xf000 | hvcC.min_spatial_segmentation_idc), out);
+        out.push_back(char(0xfc | hvcC.parallelism_type));
+        out.push_back(char(0xfc | hvcC.chroma_format_idc));
+        out.push_back(char(0xf8 | hvcC.bit_depth_luma_minus8));
+        out.push_back(char(0xf8 | hvcC.bit_depth_chroma_minus8));
+        put_number(hvcC.avg_frame_rate, out);
+        out.push_back(char(
+            (hvcC.constant_frame_rate << 6) |
+            ((hvcC.num_temporal_layers & 0x7) << 3) |
+            (hvcC.temporal_id_nested << 2) |
+            ((hvcC.naluLengthFieldSize - 1) & 0x3)
+        ));
+        out.push_back(char(hvcC.arrays.size()));
+        for (auto& array : hvcC.arrays)
+        {
+            out.push_back(char((array.array_completeness << 7) | (array.nal_unit_type & 0x3f)));
+            put_number(uint16_t(array.nalus.size()), out);
+            for (auto& nalu : array.nalus)
+            {
+                put_number(uint16_t(nalu.size()), out);
+                out.insert(out.end(), nalu.begin(), nalu.end());
+            }
+        }
+        return finish_atom(out, start_offset);
+    }
+
+    inline size_t write_hvc1(std::vector<char>& out, const hvc1_t& hvc1)
+    {
+        auto start_offset = begin_atom(out, "hvc1");
+        write_visual_sample_entry_fields(out, hvc1.width, hvc1.height);
+        write_hvcC(out, hvc1.hvcC);
+        return finish_atom(out, start_offset);
+    }
+
+    inline size_t write_hev1(std::vector<char>& out, const hev1_t& hev1)
+    {
+        auto start_offset = begin_atom(out, "hev1");
+        write_visual_sample_entry_fields(out, hev1.width, hev1.height);
+        write_hvcC(out, hev1.hvcC);
+        return finish_atom(out, start_offset);
+    }
+
+    inline void put_descriptor_header(uint8_t tag, size_t size, std::vector<char>& out)
+    {
+        out.push_back(char(tag));
+        out.push_back(char(0x80 | ((size >> 21) & 0x7f)));
+        out.push_back(char(0x80 | ((size >> 14) & 0x7f)));
+        out.push_back(char(0x80 | ((size >> 7) & 0x7f)));
+        out.push_back(char(size & 0x7f));
+    }
+
+    inline size_t write_esds(std::vector<char>& out, const esds_t& esds)
+    {
+        auto start_offset = begin_atom(out, "esds");
+        put_fullbox_header({0, 0}, out);
+        size_t decoder_specific_info = esds.decoder_specific_info.empty() ? 0 : 5 + esds.decoder_specific_info.size();
+        size_t decoder_config = 13 + decoder_specific_info;
+        put_descriptor_header(0x03, 3 + 5 + decoder_config + 5 + 1, out); // ES_Descriptor
+        put_number(esds.es_id, out);
+        out.push_back(0); // flags, stream priority
+        put_descriptor_header(0x04, decoder_config, out); // DecoderConfigDescriptor
+        out.push_back(char(esds.object_type_indication));
+        out.push_back(char((esds.stream_type << 2) | 1));
+        out.push_back(char(esds.buffer_size >> 16));
+        put_number(uint16_t(esds.buffer_size), out);
+        put_number(esds.max_bitrate, out);
+        put_number(esds.avg_bitrate, out);
+        if (!esds.decoder_specific_info.empty())
+        {
+            put_descriptor_header(0x05, esds.decoder_specific_info.size(), out); // DecoderSpecificInfo
+            out.insert(out.end(), esds.decoder_specific_info.begin(), esds.decoder_specific_info.end());
+        }
+        put_descriptor_header(0x06, 1, out); // SLConfigDescriptor
+        out.push_back(0x02); // predefined: mp4
+        return finish_atom(out, start_offset);
+    }
+
+    inline size_t write_mp4a(std::vector<char>& out, const mp4a_t& mp4a)
+    {
+        auto start_offset = begin_atom(out, "mp4a");
+        put_number(uint32_t{0}, out); // reserved
+        put_number(uint16_t{0}, out); // reserved
+        put_number(uint16_t{1}, out); // data reference index
+        put_number(uint64_t{0}, out); // reserved
+        put_number(mp4a.channel_count, out);
+        put_number(mp4a.sample_size, out);
+        put_number(uint16_t{0}, out); // pre defined
+        put_number(uint16_t{0}, out); // reserved
+        put_number(uint32_t(mp4a.sample_rate << 16), out);
+        write_esds(out, mp4a.esds);
+        return finish_atom(out, start_offset);
+    }
+
+    inline size_t write_sample_entry(std::vector<char>& out, const sample_entry_t& entry)
+    {
+        struct
+        {
+            std::vector<char>& out;
+            size_t operator()(const avc1_t& e) const {return write_avc1(out, e);}
+            size_t operator()(const hvc1_t& e) const {return write_hvc1(out, e);}
+            size_t operator()(const hev1_t& e) const {return write_hev1(out, e);}
+            size_t operator()(const mp4a_t& e) const {return write_mp4a(out, e);}
+        } write{out};
+        return std::visit(write, entry);
+    }
+
     inline size_t write_stsd(std::vector<char>& out, const stsd_t& stsd)
     {
         auto start_offset = begin_atom(out, "stsd");
         put_fullbox_header({0, 0}, out);
         put_number(uint32_t{1}, out); // entry count
-        write_avc1(out, stsd.avc1);
+        write_sample_entry(out, stsd.entry);
         return finish_atom(out, start_offset);
     }
 
@@ -957,7 +2101,7 @@ namespace my_remux::mp4
     )
     {
         auto start_offset = begin_atom(out, tag);
-        put_fullbox_header({0, 0}, out);
+        put_fullbox_header({version, 0}, out);
         put_number(uint32_t(entries.size()), out);
         for (auto&& tts : entries)
         {
@@ -967,6 +2111,16 @@ namespace my_remux::mp4
         return finish_atom(out, start_offset);
     }
 
+    inline size_t write_tts(
+        std::vector<char>& out,
+        const char* tag,
+        const tts_table_t& table,
+        uint8_t version = 0
+    )
+    {
+        return write_tts(out, tag, table.runs(), version);
+    }
+
     inline size_t write_stss(std::vector<char>& out, const stss_t& stss)
     {
         auto start_offset = begin_atom(out, "stss");
@@ -1014,16 +2168,38 @@ namespace my_remux::mp4
         return finish_atom(out, start_offset);        
     }
 
+    inline size_t write_stco(std::vector<char>& out, const std::vector<uint64_t>& co64)
+    {
+        auto start_offset = begin_atom(out, "stco");
+        put_fullbox_header({0, 0}, out);
+        put_number(uint32_t(co64.size()), out);
+        for (auto&& entry : co64)
+        {
+            put_number(uint32_t(entry), out);
+        }
+        return finish_atom(out, start_offset);
+    }
+
+    // writes stco if all offsets fit into 32 bits, co64 otherwise
+    inline size_t write_chunk_offsets(std::vector<char>& out, const std::vector<uint64_t>& co64)
+    {
+        return needs_co64(co64) ? write_co64(out, co64) : write_stco(out, co64);
+    }
+
     inline size_t write_stbl(std::vector<char>& out, const stbl_t& stbl)
     {
         auto start_offset = begin_atom(out, "stbl");
         write_stsd(out, stbl.stsd);
         write_tts(out, "stts", stbl.stts);
-        write_stss(out, stbl.stss);
-        write_tts(out, "ctts", stbl.ctts, 1);
+        // an empty stss would mean no sample is a sync sample, while the
+        // model (like a missing stss) means all are; no ctts is all zero
+        if (!stbl.stss.keyframe_indices.empty())
+            write_stss(out, stbl.stss);
+        if (!stbl.ctts.empty())
+            write_tts(out, "ctts", stbl.ctts, 1);
         write_stsc(out, stbl.stsc);
         write_stsz(out, stbl.stsz);
-        write_co64(out, stbl.co64);
+        write_chunk_offsets(out, stbl.co64);
         return finish_atom(out, start_offset);
     }
 
@@ -1069,11 +2245,11 @@ namespace my_remux::mp4
         // taken from avformat
         auto start_offset = begin_atom(out, "hdlr");
         put_fullbox_header({0, 0}, out);
-        put_number(uint32_t(0), out);
-        put_fourcc("mdir", out);
-        put_fourcc("appl", out);
-        put_number(uint32_t(0), out);
-        put_number(uint32_t(0), out);
+        put_number(uint32_t(0), out); // pre defined
+        put_fourcc(hdlr.handler_type, out);
+        put_number(uint32_t(0), out); // reserved
+        put_number(uint32_t(0), out); // reserved
+        put_number(uint32_t(0), out); // reserved
         out.insert(out.end(), hdlr.description.begin(), hdlr.description.end());
         put_number(uint8_t(0), out);
         return finish_atom(out, start_offset);
@@ -1088,6 +2264,34 @@ namespace my_remux::mp4
         return finish_atom(out, start_offset);
     }
 
+    inline size_t write_smhd(std::vector<char>& out, const smhd_t& smhd)
+    {
+        auto start_offset = begin_atom(out, "smhd");
+        put_fullbox_header({0, 0}, out);
+        put_number(smhd.balance.count(), out);
+        put_number(uint16_t(0), out); // reserved
+        return finish_atom(out, start_offset);
+    }
+
+    inline size_t write_nmhd(std::vector<char>& out, const nmhd_t&)
+    {
+        auto start_offset = begin_atom(out, "nmhd");
+        put_fullbox_header({0, 0}, out);
+        return finish_atom(out, start_offset);
+    }
+
+    inline size_t write_media_header(std::vector<char>& out, const media_header_t& media_header)
+    {
+        struct
+        {
+            std::vector<char>& out;
+            size_t operator()(const vmhd_t& h) const {return write_vmhd(out, h);}
+            size_t operator()(const smhd_t& h) const {return write_smhd(out, h);}
+            size_t operator()(const nmhd_t& h) const {return write_nmhd(out, h);}
+        } write{out};
+        return std::visit(write, media_header);
+    }
+
     inline size_t write_url(std::vector<char>& out, const url_t& url)
     {
         auto start_offset = begin_atom(out, "url ");
@@ -1114,7 +2318,7 @@ namespace my_remux::mp4
     inline size_t write_minf(std::vector<char>& out, const minf_t& minf)
     {
         auto start_offset = begin_atom(out, "minf");
-        write_vmhd(out, minf.vmhd);
+        write_media_header(out, minf.media_header);
         write_dinf(out, minf.dinf);
         write_stbl(out, minf.stbl);
         return finish_atom(out, start_offset);
@@ -1180,12 +2384,39 @@ namespace my_remux::mp4
         return finish_atom(out, start_offset);
     }
 
+    inline size_t write_trex(std::vector<char>& out, const trex_t& trex)
+    {
+        auto start_offset = begin_atom(out, "trex");
+        put_fullbox_header({0, 0}, out);
+        put_number(trex.track_ID, out);
+        put_number(trex.default_sample_description_index, out);
+        put_number(trex.default_sample_duration, out);
+        put_number(trex.default_sample_size, out);
+        put_number(trex.default_sample_flags, out);
+        return finish_atom(out, start_offset);
+    }
+
+    inline size_t write_mvex(std::vector<char>& out, const mvex_t& mvex)
+    {
+        auto start_offset = begin_atom(out, "mvex");
+        for (auto& trex : mvex.trex)
+            write_trex(out, trex);
+        return finish_atom(out, start_offset);
+    }
+
     inline size_t write_moov(std::vector<char>& out, const moov_t& moov)
     {
+        auto expected_size = size_of_moov(moov);
+        reserve_more(out, expected_size);
         auto start_offset = begin_atom(out, "moov");
         write_mvhd(out, moov.mvhd);
-        write_trak(out, moov.trak);
-        return finish_atom(out, start_offset);
+        for (auto& trak : moov.traks)
+            write_trak(out, trak);
+        if (moov.mvex)
+            write_mvex(out, *moov.mvex);
+        auto size = finish_atom(out, start_offset);
+        BOOST_ASSERT(size == expected_size);
+        return size;
     }
 
     inline size_t write_ftyp(std::vector<char>& out, const ftyp_t& ftyp)
@@ -1222,6 +2453,8 @@ namespace my_remux::mp4
             flags |= 0x10;
         if (tfhd.default_sample_flags)
             flags |= 0x20;
+        if (tfhd.default_base_is_moof)
+            flags |= 0x20000;
         put_fullbox_header({1, flags}, out);
         put_number(tfhd.track_ID, out);
         if (tfhd.base_data_offset)
@@ -1298,84 +2531,21 @@ namespace my_remux::mp4
 
     inline size_t write_moof(std::vector<char>& out, const moof_t& moof)
     {
+        auto expected_size = size_of_moof(moof);
+        reserve_more(out, expected_size);
         auto start_offset = begin_atom(out, "moof");
         write_mfhd(out, moof.mfhd);
         for (auto& traf : moof.traf)
             write_traf(out, traf);
-        return finish_atom(out, start_offset);
+        auto size = finish_atom(out, start_offset);
+        BOOST_ASSERT(size == expected_size);
+        return size;
     }
 
-#if 0
-    struct NALUFrame
-    {
-        std::vector<NALU> nalus;
-        void clear()
-        {
-            nalus.clear();
-        }
-        bool consume(const NALU& nalu)
-        {
-            BOOST_ASSERT(nalus.empty() || nalu.headerOffset() == nalus.back().endOffset());
-            if (isNewFrame(nalu))
-            {
-                return false;
-            }
-            else
-            {
-                if (nalu.isVCL())
-                {
-                    nalus.push_back(nalu);
-                }
-                return true;
-            }
-        }
-        bool isNewFrame(const NALU& nalu) const
-        {
-            if (nalus.empty())
-            {
-                return false;
-            }
-            const NALU& lastNalu = nalus.back();
-            if (!lastNalu.isVCL())
-            {
-                return false;
-            }
-            else if (nalu.isVCL())
-            {
-                return true;
-            }
-            else if ((lastNalu.idc != nalu.idc) && (lastNalu.idc == 0 || nalu.idc == 0))
-            {
-                return true;
-            }
-            else if (nalu.type >= 1 && nalu.type <= 5)
-            {
-                return true;
-            }
-            else
-            {
-                return false;
-            }
-        }
-        Box asBox() const
-        {
-            return Box{nalus.front().headerOffset(), totalLength(), 0};
-        }
-        size_t totalLength() const
-        {
-            size_t n = 0;
-            for (const NALU& nalu : nalus)
-            {
-                n += nalu.totalLength();
-            }
-            return n;
-        }
-    };
-#endif
-
     // ---------------------- file scanning utils --------------------------
 
-    inline void dumpAtoms(std::istream& file, size_t offset, size_t end, const size_t indent = 1)
+    template<typename stream_t>
+    inline void dumpAtoms(stream_t& file, size_t offset, size_t end, const size_t indent = 1)
     {
         while(offset < end)
         {
@@ -1400,11 +2570,12 @@ namespace my_remux::mp4
         }
     }
 
-    inline void iterateAtoms(std::istream& file, size_t offset, size_t end, std::function<void(MP4Atom)> f)
+    template<typename stream_t>
+    inline void iterateAtoms(stream_t& file, size_t offset, size_t end, std::function<void(MP4Atom)> f)
     {
         while(offset < end)
         {
-            MP4Atom atom = readAtomAtOffset(file, offset);
+            MP4Atom atom = readAtomAtOffset(file, offset, end);
             f(atom);
             if (atom.isContainer())
             {
@@ -1414,65 +2585,45 @@ namespace my_remux::mp4
         }
     }
 
-    template<typename T>
-    struct TreeNode
+    // node of the flat atom tree built by BasicAtomWalker.
+    // links are indices into the walker's node array, npos if absent.
+    struct AtomNode
     {
-        TreeNode(const T& data, TreeNode* parent = NULL, size_t depth = 0)
-        : data(data)
-        , parent(parent)
-        , depth(depth)
-        {}
-        TreeNode& add_child(const T& data)
-        {
-            return *children.insert(children.end(), TreeNode(data, this, depth + 1));
-        }
+        static constexpr uint32_t npos = UINT32_MAX;
+
+        MP4Atom data;
+        uint32_t parent = npos;
+        uint32_t first_child = npos;
+        uint32_t last_child = npos;
+        uint32_t next_sibling = npos;
+        uint32_t depth = 0;
+
         bool isRoot() const
         {
-            return parent == NULL;
-        }
-        template<typename F>
-        const TreeNode* find(F predicate) const
-        {
-            if (predicate(*this))
-            {
-                return this;
-            }
-            else
-            {
-                for (const TreeNode& child : children)
-                {
-                    if (const TreeNode* found = child.find(predicate))
-                    {
-                        return found;
-                    }
-                }
-            }
-            return NULL;
-        }
-        const TreeNode* find_type(const std::string& type) const
-        {
-            return find([&type](const TreeNode<MP4Atom>& node)
-                {
-                    return node.data.typeString() == type;
-                });
+            return parent == npos;
         }
-
-        T data;
-        std::list<TreeNode> children;
-        TreeNode* parent;
-        size_t depth;
     };
 
-    struct AtomWalker
+    inline uint32_t fourcc_value(std::string_view type)
     {
-        AtomWalker(std::istream& file, std::optional<size_t> file_size = std::nullopt)
+        if (type.size() != 4)
+            throw std::invalid_argument{"atom types have exactly four characters"};
+        return fourcc_t{type.data()}.value;
+    }
+
+    // lazily walks the atom tree, indexing every atom it passes into one
+    // contiguous node array, so walking many atoms does not allocate per atom.
+    template<typename stream_t>
+    struct BasicAtomWalker
+    {
+        BasicAtomWalker(stream_t& file, std::optional<size_t> file_size = std::nullopt)
         : file(file)
         , offset(0)
-        , tree(MP4Atom{0, file_size.value_or(fileLength(file)), 0, *reinterpret_cast<const uint32_t*>("file")})
-        , currentNode(&tree)
+        , nodes{AtomNode{MP4Atom{0, file_size.value_or(fileLength(file)), 0, fourcc_t{"file"}.value}}}
+        , currentNode(0)
         {
         }
-        MP4Atom at(const std::string& type)
+        MP4Atom at(std::string_view type)
         {
             if (auto found = find(type))
             {
@@ -1483,35 +2634,78 @@ namespace my_remux::mp4
                 throw std::out_of_range{"atom not found"};
             }
         }
-        std::optional<MP4Atom> find(const std::string& type)
+        // first atom of the given type in file order
+        std::optional<MP4Atom> find(std::string_view type)
         {
-            if (const TreeNode<MP4Atom>* found = tree.find_type(type))
+            auto value = fourcc_value(type);
+            for (auto& node : nodes)
             {
-                return found->data;
+                if (node.data.type == value)
+                {
+                    return node.data;
+                }
             }
             while (next())
             {
-                if (top().typeString() == type)
+                if (top().type == value)
                 {
                     return top();
                 }
             }
             return std::nullopt;
         }
-        const TreeNode<MP4Atom>& root() {return tree;}
+        // atom by slash separated path from the root, e.g. "moov/trak/mdia/minf/stbl/stsz".
+        // each component matches the first child of that type.
+        std::optional<MP4Atom> find_path(std::string_view path)
+        {
+            uint32_t node = 0;
+            while (!path.empty())
+            {
+                auto separator = path.find('/');
+                auto value = fourcc_value(path.substr(0, separator));
+                path = separator == std::string_view::npos ? std::string_view{} : path.substr(separator + 1);
+                auto child = find_child(node, value);
+                while (child == AtomNode::npos && !isComplete(node) && next())
+                {
+                    if (nodes[currentNode].parent == node && top().type == value)
+                    {
+                        child = currentNode;
+                    }
+                }
+                if (child == AtomNode::npos)
+                {
+                    return std::nullopt;
+                }
+                node = child;
+            }
+            return nodes[node].data;
+        }
+        MP4Atom at_path(std::string_view path)
+        {
+            if (auto found = find_path(path))
+            {
+                return *found;
+            }
+            else
+            {
+                throw std::out_of_range{"atom not found"};
+            }
+        }
+        const AtomNode& root() const {return nodes.front();}
+        const AtomNode& node(uint32_t index) const {return nodes[index];}
         bool next()
         {
-            while (!currentNode->isRoot() && offset >= top().endOffset())
+            while (!nodes[currentNode].isRoot() && offset >= top().endOffset())
             {
-                currentNode = currentNode->parent;
+                currentNode = nodes[currentNode].parent;
             }
             if (offset >= top().endOffset())
             {
                 return false;
             }
-            // top must be a container... :)
-            MP4Atom atom = readAtomAtOffset(file, offset);
-            currentNode = &currentNode->add_child(atom);
+            // top must be a container... :) size 0 atoms reach to its end
+            MP4Atom atom = readAtomAtOffset(file, offset, top().endOffset());
+            currentNode = add_child(currentNode, atom);
             if (top().isContainer())
             {
                 offset = top().content_offset + top().childOffset();
@@ -1522,14 +2716,15 @@ namespace my_remux::mp4
             }
             return true;
         }
-        const MP4Atom& top()
+        // note: invalidated by the next call to next()
+        const MP4Atom& top() const
         {
-            return currentNode->data;
+            return nodes[currentNode].data;
         }
         void printPath() const
         {
             bool first = true;
-            for (const TreeNode<MP4Atom>* node = currentNode; node != NULL; node = node->parent)
+            for (uint32_t node = currentNode; node != AtomNode::npos; node = nodes[node].parent)
             {
                 if (first)
                 {
@@ -1539,28 +2734,61 @@ namespace my_remux::mp4
                 {
                     std::cout << ".";
                 }
-                std::cout << node->data.typeString();
+                std::cout << nodes[node].data.typeString();
             }
             std::cout << std::endl;
         }
-        std::istream& file;
+        stream_t& file;
         size_t offset;
-        TreeNode<MP4Atom> tree;
-        TreeNode<MP4Atom>* currentNode;
+        std::vector<AtomNode> nodes;
+        uint32_t currentNode;
+
+    private:
+        uint32_t add_child(uint32_t parent, const MP4Atom& atom)
+        {
+            auto index = uint32_t(nodes.size());
+            AtomNode child{atom, parent};
+            child.depth = nodes[parent].depth + 1;
+            nodes.push_back(child);
+            auto& p = nodes[parent];
+            if (p.last_child == AtomNode::npos)
+                p.first_child = index;
+            else
+                nodes[p.last_child].next_sibling = index;
+            p.last_child = index;
+            return index;
+        }
+        uint32_t find_child(uint32_t parent, uint32_t type) const
+        {
+            for (auto child = nodes[parent].first_child; child != AtomNode::npos; child = nodes[child].next_sibling)
+            {
+                if (nodes[child].data.type == type)
+                {
+                    return child;
+                }
+            }
+            return AtomNode::npos;
+        }
+        // true once all children of node have been indexed
+        bool isComplete(uint32_t node) const
+        {
+            auto& atom = nodes[node].data;
+            return !atom.isContainer() || offset >= atom.endOffset();
+        }
     };
 
-    static inline void dumpAtoms(std::istream& file)
+    using AtomWalker = BasicAtomWalker<std::istream>;
+
+    template<typename stream_t>
+    static inline void dumpAtoms(stream_t& file)
     {
-        file.seekg(0, std::ios_base::end);
-        size_t length = file.tellg();
-        dumpAtoms(file, 0, length);
+        dumpAtoms(file, 0, fileLength(file));
     }
 
-    static inline void iterateAtoms(std::istream& file, std::function<void(MP4Atom)> f)
+    template<typename stream_t>
+    static inline void iterateAtoms(stream_t& file, std::function<void(MP4Atom)> f)
     {
-        file.seekg(0, std::ios_base::end);
-        size_t length = file.tellg();
-        iterateAtoms(file, 0, length, f);
+        iterateAtoms(file, 0, fileLength(file), f);
     }
 }
 // todo:
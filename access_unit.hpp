@@ -0,0 +1,127 @@
+#pragma once
+
+#include "annexb.hpp"
+#include "nalu.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// ---------------------- access unit assembly --------------------------
+
+namespace game_on
+{
+    // one coded picture with its parameter sets and sei. the nalus point
+    // into the caller's buffer, nothing is copied.
+    struct access_unit_t
+    {
+        std::vector<nalu_span_t> nalus;
+        bool keyframe = false;
+        bool has_vcl = false;
+
+        bool empty() const
+        {
+            return nalus.empty();
+        }
+
+        void clear()
+        {
+            nalus.clear();
+            keyframe = false;
+            has_vcl = false;
+        }
+    };
+
+    // true if nalu begins a new access unit, given whether the current one
+    // already has a vcl nalu (h.264 7.4.1.2.3, h.265 7.4.2.4.4)
+    inline bool nalu_starts_access_unit(nalu_kind_t kind, nalu_span_t nalu, bool seen_vcl)
+    {
+        auto type = nalu_type(kind, nalu.data);
+        switch (kind)
+        {
+        case nalu_kind_t::h264:
+            if (type == 9) // access unit delimiter
+                return true;
+            if (!seen_vcl)
+                return false;
+            if (type == 6 || type == 7 || type == 8 || (type >= 14 && type <= 18))
+                return true;
+            // first_mb_in_slice is ue(v), which is 0 iff its first bit is set
+            if (type == 1 || type == 5)
+                return nalu.size > 1 && (uint8_t(nalu.data[1]) & 0x80);
+            return false;
+        case nalu_kind_t::h265:
+            if (type == 35) // access unit delimiter
+                return true;
+            if (!seen_vcl)
+                return false;
+            if ((type >= 32 && type <= 34) || type == 39 || (type >= 41 && type <= 44) || (type >= 48 && type <= 55))
+                return true;
+            // first_slice_segment_in_pic_flag follows the two byte header
+            if (type <= 31)
+                return nalu.size > 2 && (uint8_t(nalu.data[2]) & 0x80);
+            return false;
+        }
+        return false;
+    }
+
+    // groups a stream of nalus into access units. push nalus in decoding
+    // order; whenever one starts a new access unit the previous one is handed
+    // to the callback. the callback's access unit is reused afterwards.
+    class access_unit_assembler_t
+    {
+    public:
+        explicit access_unit_assembler_t(nalu_kind_t kind)
+        : _kind{kind}
+        {
+        }
+
+        template<typename F>
+        void push(nalu_span_t nalu, F&& on_access_unit)
+        {
+            if (nalu.size == 0)
+                return;
+            if (!_current.empty() && nalu_starts_access_unit(_kind, nalu, _current.has_vcl))
+            {
+                on_access_unit(static_cast<const access_unit_t&>(_current));
+                _current.clear();
+            }
+            auto type = nalu_type(_kind, nalu.data);
+            if (nalu_is_vcl(_kind, type))
+            {
+                _current.has_vcl = true;
+                _current.keyframe = _current.keyframe || nalu_is_keyframe(_kind, type);
+            }
+            _current.nalus.push_back(nalu);
+        }
+
+        // hands out the last access unit, e.g. at the end of the stream
+        template<typename F>
+        void flush(F&& on_access_unit)
+        {
+            if (_current.empty())
+                return;
+            on_access_unit(static_cast<const access_unit_t&>(_current));
+            _current.clear();
+        }
+
+        nalu_kind_t kind() const
+        {
+            return _kind;
+        }
+
+    private:
+        nalu_kind_t _kind;
+        access_unit_t _current;
+    };
+
+    // splits an annex b byte stream into access units
+    template<typename F>
+    inline void for_each_access_unit(const char* begin, const char* end, nalu_kind_t kind, F&& on_access_unit)
+    {
+        access_unit_assembler_t assembler{kind};
+        for_each_annexb_nalu(begin, end, [&](nalu_span_t nalu) {
+            assembler.push(nalu, on_access_unit);
+        });
+        assembler.flush(on_access_unit);
+    }
+}
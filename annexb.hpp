@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// ---------------------- annex b byte streams --------------------------
+// encoders hand out nalus separated by 00 00 01 / 00 00 00 01 start codes,
+// mp4 wants them length prefixed (avcc), decoders often want start codes.
+
+namespace game_on
+{
+    // first position of a 00 00 01 start code in [begin, end), or end.
+    // a four byte start code is found at its second byte.
+    inline const char* find_start_code(const char* begin, const char* end)
+    {
+        auto p = reinterpret_cast<const unsigned char*>(begin);
+        auto e = reinterpret_cast<const unsigned char*>(end);
+#if defined(__AVX2__)
+        const __m256i zero32 = _mm256_setzero_si256();
+        const __m256i one32 = _mm256_set1_epi8(1);
+        while (e - p >= 34)
+        {
+            // only a 01 can end a start code, check for it first
+            __m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 2));
+            uint32_t ones = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v2, one32)));
+            if (ones)
+            {
+                __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+                __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 1));
+                uint32_t zeros = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, zero32))) &
+                                 uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, zero32)));
+                if (uint32_t hits = ones & zeros)
+                    return reinterpret_cast<const char*>(p + __builtin_ctz(hits));
+            }
+            p += 32;
+        }
+#endif
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi8(1);
+        while (e - p >= 18)
+        {
+            __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2));
+            uint32_t ones = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v2, one)));
+            if (ones)
+            {
+                __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1));
+                uint32_t zeros = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v0, zero))) &
+                                 uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v1, zero)));
+                if (uint32_t hits = ones & zeros)
+                    return reinterpret_cast<const char*>(p + __builtin_ctz(hits));
+            }
+            p += 16;
+        }
+#endif
+        // memchr for the 01 and look back for the two zeros
+        while (e - p >= 3)
+        {
+            auto one_at = static_cast<const unsigned char*>(std::memchr(p + 2, 1, size_t(e - p - 2)));
+            if (!one_at)
+                break;
+            if (one_at[-1] == 0 && one_at[-2] == 0)
+                return reinterpret_cast<const char*>(one_at - 2);
+            p = one_at - 1;
+        }
+        return end;
+    }
+
+    struct nalu_span_t
+    {
+        const char* data;
+        size_t size;
+    };
+
+    // calls f(nalu_span_t) for every nalu of an annex b stream, without the
+    // start codes and the zero bytes padding up to the next start code
+    template<typename F>
+    inline void for_each_annexb_nalu(const char* begin, const char* end, F&& f)
+    {
+        auto start = find_start_code(begin, end);
+        while (start != end)
+        {
+            auto nalu = start + 3;
+            auto next = find_start_code(nalu, end);
+            auto nalu_end = next;
+            while (nalu_end > nalu && nalu_end[-1] == 0)
+                --nalu_end;
+            if (nalu_end > nalu)
+                f(nalu_span_t{nalu, size_t(nalu_end - nalu)});
+            start = next;
+        }
+    }
+
+    // reserve for n more bytes. reserving the exact size on every append
+    // would disable the geometric growth and make repeated appends quadratic.
+    inline void reserve_more(std::vector<char>& v, size_t n)
+    {
+        if (v.capacity() - v.size() < n)
+            v.reserve(std::max(v.size() + n, 2 * v.capacity()));
+    }
+
+    inline void put_length(char* out, size_t length, size_t length_size)
+    {
+        for (size_t i = 0; i < length_size; ++i)
+            out[i] = char(length >> (8 * (length_size - 1 - i)));
+    }
+
+    // appends the nalus of an annex b stream to out, each with a big endian
+    // length prefix of length_size bytes (4 for mp4 samples)
+    inline size_t annexb_to_avcc(const char* data, size_t size, std::vector<char>& out, size_t length_size = 4)
+    {
+        auto start_size = out.size();
+        reserve_more(out, size + size / 64);
+        for_each_annexb_nalu(data, data + size, [&](nalu_span_t nalu) {
+            if (length_size < 4 && nalu.size >> (8 * length_size))
+                throw std::runtime_error{"annexb_to_avcc: nalu too large for length field"};
+            auto at = out.size();
+            out.resize(at + length_size);
+            put_length(out.data() + at, nalu.size, length_size);
+            out.insert(out.end(), nalu.data, nalu.data + nalu.size);
+        });
+        return out.size() - start_size;
+    }
+
+    // converts an annex b stream to 4 byte length prefixes in place. this works
+    // when every start code has four bytes, as the length field then takes its
+    // place; otherwise the conversion happens through a temporary buffer.
+    inline void annexb_to_avcc(std::vector<char>& data)
+    {
+        auto begin = data.data();
+        auto end = begin + data.size();
+        bool in_place = true;
+        size_t nalu_count = 0;
+        for_each_annexb_nalu(begin, end, [&](nalu_span_t nalu) {
+            // a four byte start code directly followed by its nalu, and that
+            // nalu running up to the next start code
+            in_place = in_place && nalu.data - begin >= 4 && std::memcmp(nalu.data - 4, "\0\0\0\1", 4) == 0;
+            ++nalu_count;
+        });
+        if (!in_place || nalu_count == 0)
+        {
+            std::vector<char> out;
+            annexb_to_avcc(data.data(), data.size(), out);
+            data.swap(out);
+            return;
+        }
+        // write position never passes read position: each nalu stays where it
+        // is or moves left by the trailing zeros removed before it
+        char* w = begin;
+        for_each_annexb_nalu(begin, end, [&](nalu_span_t nalu) {
+            put_length(w, nalu.size, 4);
+            std::memmove(w + 4, nalu.data, nalu.size);
+            w += 4 + nalu.size;
+        });
+        data.resize(size_t(w - begin));
+    }
+
+    // appends the nalus of a length prefixed buffer to out with 4 byte start codes
+    inline size_t avcc_to_annexb(const char* data, size_t size, std::vector<char>& out, size_t length_size = 4)
+    {
+        auto start_size = out.size();
+        reserve_more(out, size + (length_size < 4 ? size / 16 : 0));
+        size_t offset = 0;
+        while (offset < size)
+        {
+            if (size - offset < length_size)
+                throw std::runtime_error{"avcc_to_annexb: truncated length field"};
+            size_t length = 0;
+            for (size_t i = 0; i < length_size; ++i)
+                length = (length << 8) | uint8_t(data[offset + i]);
+            offset += length_size;
+            if (length > size - offset)
+                throw std::runtime_error{"avcc_to_annexb: nalu exceeds buffer"};
+            out.insert(out.end(), {0, 0, 0, 1});
+            out.insert(out.end(), data + offset, data + offset + length);
+            offset += length;
+        }
+        return out.size() - start_size;
+    }
+
+    // replaces 4 byte length prefixes with 4 byte start codes in place
+    inline void avcc_to_annexb(char* data, size_t size)
+    {
+        size_t offset = 0;
+        while (offset < size)
+        {
+            if (size - offset < 4)
+                throw std::runtime_error{"avcc_to_annexb: truncated length field"};
+            auto p = reinterpret_cast<unsigned char*>(data + offset);
+            size_t length = (size_t(p[0]) << 24) | (size_t(p[1]) << 16) | (size_t(p[2]) << 8) | size_t(p[3]);
+            if (length > size - offset - 4)
+                throw std::runtime_error{"avcc_to_annexb: nalu exceeds buffer"};
+            std::memcpy(p, "\0\0\0\1", 4);
+            offset += 4 + length;
+        }
+    }
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "annexb.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// ---------------------- bitstream reading --------------------------
+// sequential reader for parameter sets and slice headers. from_bits is fine
+// for fixed positions, but everything after the first ue(v) field moves.
+
+namespace game_on
+{
+    // appends the rbsp of a nalu to out, i.e. the payload with the emulation
+    // prevention bytes (the 03 in 00 00 03) removed
+    inline void nalu_to_rbsp(const char* data, size_t size, std::vector<char>& out)
+    {
+        reserve_more(out, size);
+        auto begin = reinterpret_cast<const unsigned char*>(data);
+        auto end = begin + size;
+        auto copied = begin;
+        auto p = begin + 2;
+        while (p < end)
+        {
+            auto three = static_cast<const unsigned char*>(std::memchr(p, 3, size_t(end - p)));
+            if (!three)
+                break;
+            if (three[-1] == 0 && three[-2] == 0)
+            {
+                out.insert(out.end(), copied, three);
+                copied = three + 1;
+                // the zero run starts over after the dropped byte
+                p = three + 3;
+            }
+            else
+            {
+                p = three + 1;
+            }
+        }
+        out.insert(out.end(), copied, end);
+    }
+
+    inline std::vector<char> nalu_to_rbsp(const char* data, size_t size)
+    {
+        std::vector<char> rbsp;
+        nalu_to_rbsp(data, size, rbsp);
+        return rbsp;
+    }
+
+    // msb first bit reader over an rbsp. keeps up to 64 bits in a register
+    // and refills a whole word at a time while at least 8 bytes are left.
+    // reading past the end throws std::out_of_range.
+    class bit_reader_t
+    {
+    public:
+        bit_reader_t(const char* data, size_t size)
+        : _p{reinterpret_cast<const unsigned char*>(data)}
+        , _end{_p + size}
+        , _size{size}
+        {
+            // position of the last set bit, the stop bit
+            auto last = _end;
+            while (last != _p && last[-1] == 0)
+                --last;
+            _stop_bit = last == _p ? 0 : 8 * size_t(last - _p) - 1 - size_t(__builtin_ctz(last[-1]));
+        }
+
+        explicit bit_reader_t(const std::vector<char>& rbsp)
+        : bit_reader_t{rbsp.data(), rbsp.size()}
+        {
+        }
+
+        // reads n <= 32 bits
+        uint32_t read_bits(unsigned n)
+        {
+            if (n == 0)
+                return 0;
+            if (_bits < n)
+                refill();
+            if (_bits < n)
+                throw std::out_of_range{"bit_reader_t: read past the end"};
+            auto result = uint32_t(_cache >> (64 - n));
+            _cache <<= n;
+            _bits -= n;
+            return result;
+        }
+
+        bool read_bit()
+        {
+            return read_bits(1);
+        }
+
+        void skip_bits(size_t n)
+        {
+            for (; n > 32; n -= 32)
+                read_bits(32);
+            read_bits(unsigned(n));
+        }
+
+        // unsigned exp-golomb, ue(v)
+        uint32_t read_ue()
+        {
+            if (_bits < 32)
+                refill();
+            // the cache is zero below the valid bits, so leading zeros beyond
+            // them mean the code is cut off
+            auto leading_zeros = _cache ? unsigned(__builtin_clzll(_cache)) : 64u;
+            if (leading_zeros > 31 && _bits > 31)
+                throw std::runtime_error{"bit_reader_t: exp-golomb code too long"};
+            if (leading_zeros >= _bits)
+                throw std::out_of_range{"bit_reader_t: read past the end"};
+            _cache <<= leading_zeros;
+            _bits -= leading_zeros;
+            return uint32_t(uint64_t(read_bits(leading_zeros + 1)) - 1);
+        }
+
+        // signed exp-golomb, se(v)
+        int32_t read_se()
+        {
+            auto code = read_ue();
+            return code & 1 ? int32_t((uint64_t(code) + 1) / 2) : -int32_t(code / 2);
+        }
+
+        size_t bits_read() const
+        {
+            return 8 * (_size - size_t(_end - _p)) - _bits;
+        }
+
+        size_t bits_left() const
+        {
+            return 8 * size_t(_end - _p) + _bits;
+        }
+
+        bool byte_aligned() const
+        {
+            return bits_read() % 8 == 0;
+        }
+
+        // false once only the rbsp stop bit and its trailing zeros are left
+        bool more_rbsp_data() const
+        {
+            return bits_read() < _stop_bit;
+        }
+
+    private:
+        void refill()
+        {
+            if (_end - _p >= 8)
+            {
+                uint64_t word;
+                std::memcpy(&word, _p, 8);
+#if __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+                word = __builtin_bswap64(word);
+#endif
+                _cache |= word >> _bits;
+                auto bytes = (63 - _bits) / 8;
+                _p += bytes;
+                _bits += 8 * bytes;
+                // the bits below the valid ones have to stay zero
+                _cache &= ~(~uint64_t(0) >> _bits);
+                return;
+            }
+            while (_bits <= 56 && _p != _end)
+            {
+                _cache |= uint64_t(*_p++) << (56 - _bits);
+                _bits += 8;
+            }
+        }
+
+        const unsigned char* _p;
+        const unsigned char* _end;
+        size_t _size;
+        size_t _stop_bit;
+        uint64_t _cache = 0;
+        unsigned _bits = 0;
+    };
+}
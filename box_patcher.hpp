@@ -0,0 +1,429 @@
+#pragma once
+
+#include "MP4Atom.hpp"
+#include "byte_source.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// ---------------------- in place box patching --------------------------
+// metadata updates should touch the bytes that change, not the whole file.
+// fixed size fields are overwritten where they are. a box that changes its
+// size takes the room from a neighbouring free box, or leaves a free box
+// behind when it shrinks. only if neither works the moov is rewritten, at
+// the end of the file, and the old one becomes free space. the mdat never
+// moves, so chunk offsets stay valid in every case.
+
+namespace my_remux::mp4
+{
+    class box_patcher_t
+    {
+    public:
+        explicit box_patcher_t(const std::string& path)
+        : _path{path}
+        , _fd{::open(path.c_str(), O_RDWR | O_CLOEXEC)}
+        {
+            if (_fd < 0)
+                throw std::system_error{errno, std::generic_category(), "box_patcher_t: could not open '" + path + "'"};
+            reindex();
+        }
+
+        box_patcher_t(const box_patcher_t&) = delete;
+        box_patcher_t& operator=(const box_patcher_t&) = delete;
+
+        ~box_patcher_t()
+        {
+            ::close(_fd);
+        }
+
+        // the box tree, node 0 being the whole file. indices are only valid
+        // until the next structural change (replace_box, resizing setters).
+        const std::vector<AtomNode>& nodes() const
+        {
+            return _nodes;
+        }
+
+        const AtomNode& node(uint32_t index) const
+        {
+            return _nodes.at(index);
+        }
+
+        // the nth box with the given path, e.g. "moov/trak/tkhd"
+        std::optional<uint32_t> find(std::string_view path, size_t nth = 0) const
+        {
+            for (uint32_t i = 1; i < _nodes.size(); ++i)
+                if (matches(i, path) && nth-- == 0)
+                    return i;
+            return std::nullopt;
+        }
+
+        uint32_t at(std::string_view path, size_t nth = 0) const
+        {
+            if (auto index = find(path, nth))
+                return *index;
+            throw std::runtime_error{"box_patcher_t: no box '" + std::string(path) + "'"};
+        }
+
+        // bytes of a box as currently in the file
+        byte_span_t box_bytes(uint32_t index) const
+        {
+            auto& atom = node(index).data;
+            return _file.span().subspan(atom.headerOffset(), atom.totalLength());
+        }
+
+        // duration of mvhd, tkhd or mdhd. a version 0 box that can't hold
+        // the value is rewritten as version 1, which grows it by 12 bytes.
+        void set_duration(uint32_t index, uint64_t duration)
+        {
+            set_header_field(index, header_field_t::duration, duration);
+        }
+
+        void set_creation_time(uint32_t index, uint64_t time)
+        {
+            set_header_field(index, header_field_t::creation_time, time);
+        }
+
+        void set_modification_time(uint32_t index, uint64_t time)
+        {
+            set_header_field(index, header_field_t::modification_time, time);
+        }
+
+        void set_track_id(uint32_t tkhd, uint32_t track_id)
+        {
+            auto& atom = node(tkhd).data;
+            if (!atom.isType("tkhd"))
+                throw std::invalid_argument{"box_patcher_t: track ids live in tkhd"};
+            auto version = uint8_t(box_bytes(tkhd).data[atom.header_length]);
+            write_number(atom.content_offset + (version == 0 ? 12 : 20), track_id);
+        }
+
+        // replaces a box with new serialized bytes, including the header
+        void replace_box(uint32_t index, std::vector<char> box)
+        {
+            auto& atom = node(index).data;
+            if (box.size() < 8)
+                throw std::invalid_argument{"box_patcher_t: replacement is not a box"};
+            auto old_size = int64_t(atom.totalLength());
+            auto delta = int64_t(box.size()) - old_size;
+            auto offset = atom.headerOffset();
+            if (delta == 0)
+            {
+                write_bytes(offset, box.data(), box.size());
+            }
+            else if (delta <= -8)
+            {
+                // the rest becomes a free box, the parents keep their size
+                box.reserve(size_t(old_size));
+                put_free_header(box, uint64_t(-delta));
+                box.resize(size_t(old_size));
+                write_bytes(offset, box.data(), box.size());
+            }
+            else if (!resize_into_free(index, box, delta) && !relocate_moov(index, box))
+            {
+                throw std::runtime_error{"box_patcher_t: no room to resize '" + atom.typeString() + "' outside of moov"};
+            }
+            reindex();
+        }
+
+        // flushes the patches to the disk
+        void sync()
+        {
+            if (::fsync(_fd) != 0)
+                throw std::system_error{errno, std::generic_category(), "box_patcher_t: fsync failed"};
+        }
+
+        // bytes written so far, as a measure of what a patch costs
+        uint64_t bytes_written() const
+        {
+            return _bytes_written;
+        }
+
+    private:
+        enum class header_field_t
+        {
+            creation_time,
+            modification_time,
+            duration,
+        };
+
+        // mvhd, tkhd and mdhd share the layout of the fields that widen in
+        // version 1: creation and modification time first, the duration
+        // after one (mvhd, mdhd) or two (tkhd) 32 bit fields
+        void set_header_field(uint32_t index, header_field_t field, uint64_t value)
+        {
+            auto& atom = node(index).data;
+            if (!atom.isType("mvhd") && !atom.isType("tkhd") && !atom.isType("mdhd"))
+                throw std::invalid_argument{"box_patcher_t: '" + atom.typeString() + "' has no such field"};
+            auto bytes = box_bytes(index);
+            auto version = uint8_t(bytes.data[atom.header_length]);
+            size_t gap = atom.isType("tkhd") ? 8 : 4;
+            auto field_offset = [&](uint8_t version) {
+                size_t width = version == 0 ? 4 : 8;
+                switch (field)
+                {
+                case header_field_t::creation_time: return size_t(4);
+                case header_field_t::modification_time: return 4 + width;
+                case header_field_t::duration: break;
+                }
+                return 4 + 2 * width + gap;
+            };
+            if (version == 1)
+            {
+                write_number(atom.content_offset + field_offset(1), value);
+            }
+            else if (value <= UINT32_MAX)
+            {
+                write_number(atom.content_offset + field_offset(0), uint32_t(value));
+            }
+            else
+            {
+                auto box = widen_to_version_1(bytes, atom.header_length, gap);
+                copy_number(value, box.data() + atom_header_size + field_offset(1));
+                replace_box(index, std::move(box));
+            }
+        }
+
+        // the box as version 1, always with a 32 bit size
+        static std::vector<char> widen_to_version_1(byte_span_t bytes, size_t header_length, size_t gap)
+        {
+            byte_reader_t reader{bytes};
+            reader.seekg(header_length + 4);
+            auto creation_time = read_to_host<uint32_t>(reader);
+            auto modification_time = read_to_host<uint32_t>(reader);
+            auto body = header_length + 12;
+            std::vector<char> box;
+            box.reserve(bytes.size + 12);
+            put_number(uint32_t(0), box);
+            box.insert(box.end(), bytes.data + 4, bytes.data + 8); // type
+            put_fullbox_header({1, uint32_t(uint8_t(bytes.data[header_length + 1])) << 16 |
+                                   uint32_t(uint8_t(bytes.data[header_length + 2])) << 8 |
+                                   uint32_t(uint8_t(bytes.data[header_length + 3]))}, box);
+            put_number(uint64_t(creation_time), box);
+            put_number(uint64_t(modification_time), box);
+            box.insert(box.end(), bytes.data + body, bytes.data + body + gap);
+            reader.seekg(body + gap);
+            put_number(uint64_t(read_to_host<uint32_t>(reader)), box);
+            box.insert(box.end(), bytes.data + body + gap + 4, bytes.end());
+            copy_number(uint32_t(box.size()), box.data());
+            return box;
+        }
+
+        static void put_free_header(std::vector<char>& out, uint64_t size)
+        {
+            if (size > UINT32_MAX)
+                throw std::runtime_error{"box_patcher_t: free box too large"};
+            put_number(uint32_t(size), out);
+            put_fourcc("free", out);
+        }
+
+        // grows or shrinks the box by taking the room from or giving it to a
+        // free box right after it. the free box may also follow one of the
+        // ancestors if the box is the last child on the way up; those
+        // ancestors then change their size along with the box.
+        bool resize_into_free(uint32_t index, const std::vector<char>& box, int64_t delta)
+        {
+            std::vector<uint32_t> resized; // ancestors below the free box's parent
+            uint32_t current = index;
+            for (;;)
+            {
+                auto& n = _nodes[current];
+                if (n.next_sibling != AtomNode::npos)
+                {
+                    auto& free = _nodes[n.next_sibling].data;
+                    if (!free.isType("free") && !free.isType("skip"))
+                        return false;
+                    auto remaining = int64_t(free.totalLength()) - delta;
+                    if (remaining != 0 && remaining < int64_t(free.header_length))
+                        return false;
+                    for (auto ancestor : resized)
+                        if (!fits_size_field(ancestor, delta))
+                            return false;
+                    auto end = _nodes[index].data.headerOffset() + box.size();
+                    // the free box first: a crash in between leaves the old
+                    // box followed by a shorter, still parseable free box
+                    if (remaining > 0)
+                    {
+                        std::vector<char> header;
+                        put_free_header(header, uint64_t(remaining));
+                        auto free_offset = free.endOffset() - uint64_t(remaining);
+                        if (delta > 0)
+                        {
+                            write_bytes(free_offset, header.data(), header.size());
+                            write_bytes(_nodes[index].data.headerOffset(), box.data(), box.size());
+                        }
+                        else
+                        {
+                            write_bytes(_nodes[index].data.headerOffset(), box.data(), box.size());
+                            write_bytes(free_offset, header.data(), header.size());
+                        }
+                        BOOST_ASSERT(free_offset == end);
+                    }
+                    else
+                    {
+                        write_bytes(_nodes[index].data.headerOffset(), box.data(), box.size());
+                    }
+                    for (auto ancestor : resized)
+                        add_to_size(ancestor, delta);
+                    return true;
+                }
+                if (n.parent == 0 || n.parent == AtomNode::npos)
+                    return false;
+                current = n.parent;
+                resized.push_back(current);
+            }
+        }
+
+        // rewrites the moov containing the box with the box replaced. a moov
+        // at the end of the file is rewritten in place, any other is appended
+        // and the old one turned into a free box afterwards, so a crash in
+        // between leaves the old moov in effect.
+        bool relocate_moov(uint32_t index, const std::vector<char>& box)
+        {
+            uint32_t moov = index;
+            std::vector<uint32_t> ancestors;
+            while (_nodes[moov].parent != 0)
+            {
+                moov = _nodes[moov].parent;
+                ancestors.push_back(moov);
+            }
+            if (moov == index || !_nodes[moov].data.isType("moov"))
+                return false;
+            auto& moov_atom = _nodes[moov].data;
+            auto& atom = _nodes[index].data;
+            auto delta = int64_t(box.size()) - int64_t(atom.totalLength());
+            auto moov_bytes = box_bytes(moov);
+            std::vector<char> out;
+            out.reserve(size_t(int64_t(moov_bytes.size) + delta));
+            auto relative = atom.headerOffset() - moov_atom.headerOffset();
+            out.insert(out.end(), moov_bytes.begin(), moov_bytes.begin() + relative);
+            out.insert(out.end(), box.begin(), box.end());
+            out.insert(out.end(), moov_bytes.begin() + relative + atom.totalLength(), moov_bytes.end());
+            for (auto ancestor : ancestors)
+            {
+                auto& a = _nodes[ancestor].data;
+                auto at = out.data() + (a.headerOffset() - moov_atom.headerOffset());
+                auto size = uint64_t(int64_t(a.totalLength()) + delta);
+                if (a.header_length == 16)
+                    copy_number(size, at + 8);
+                else if (size <= UINT32_MAX)
+                    copy_number(uint32_t(size), at);
+                else
+                    throw std::runtime_error{"box_patcher_t: moov too large for its size field"};
+            }
+            bool at_end = moov_atom.endOffset() == _file.size();
+            if (at_end)
+            {
+                write_bytes(moov_atom.headerOffset(), out.data(), out.size());
+                if (delta < 0 && ::ftruncate(_fd, off_t(moov_atom.headerOffset() + out.size())) != 0)
+                    throw std::system_error{errno, std::generic_category(), "box_patcher_t: ftruncate failed"};
+            }
+            else
+            {
+                write_bytes(append_offset(), out.data(), out.size());
+                write_bytes(moov_atom.headerOffset() + 4, "free", 4);
+            }
+            return true;
+        }
+
+        // where an appended box becomes the last top level box. a size 0 box
+        // at the end, like the mdat of an unfinished recording, gets its
+        // real size first; the appended box would be inside it otherwise.
+        uint64_t append_offset()
+        {
+            auto last = _nodes[0].last_child;
+            if (last == AtomNode::npos)
+                return _file.size();
+            auto& atom = _nodes[last].data;
+            if (atom.endOffset() != _file.size())
+                throw std::runtime_error{"box_patcher_t: the end of the file is not a box boundary"};
+            if (read_to_host<uint32_t>(_file.span().data + atom.headerOffset()) == 0)
+            {
+                if (atom.totalLength() > UINT32_MAX)
+                    throw std::runtime_error{"box_patcher_t: size 0 '" + atom.typeString() + "' too large to close before the moov"};
+                write_number(atom.headerOffset(), uint32_t(atom.totalLength()));
+            }
+            return _file.size();
+        }
+
+        bool fits_size_field(uint32_t index, int64_t delta) const
+        {
+            auto& atom = _nodes[index].data;
+            return atom.header_length == 16 || int64_t(atom.totalLength()) + delta <= int64_t(UINT32_MAX);
+        }
+
+        void add_to_size(uint32_t index, int64_t delta)
+        {
+            auto& atom = _nodes[index].data;
+            auto size = uint64_t(int64_t(atom.totalLength()) + delta);
+            if (atom.header_length == 16)
+                write_number(atom.headerOffset() + 8, size);
+            else
+                write_number(atom.headerOffset(), uint32_t(size));
+        }
+
+        bool matches(uint32_t index, std::string_view path) const
+        {
+            for (;;)
+            {
+                auto separator = path.rfind('/');
+                auto type = separator == std::string_view::npos ? path : path.substr(separator + 1);
+                if (index == 0 || index == AtomNode::npos || type.size() != 4 || !_nodes[index].data.isType(fourcc_t{type.data()}))
+                    return false;
+                index = _nodes[index].parent;
+                if (separator == std::string_view::npos)
+                    return index == 0;
+                path = path.substr(0, separator);
+            }
+        }
+
+        template<typename T>
+        void write_number(uint64_t offset, T value)
+        {
+            char bytes[sizeof(T)];
+            copy_number(value, bytes);
+            write_bytes(offset, bytes, sizeof(T));
+        }
+
+        void write_bytes(uint64_t offset, const char* data, size_t size)
+        {
+            size_t written = 0;
+            while (written < size)
+            {
+                auto n = ::pwrite(_fd, data + written, size - written, off_t(offset + written));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    throw std::system_error{errno, std::generic_category(), "box_patcher_t: pwrite failed"};
+                written += size_t(n);
+            }
+            _bytes_written += size;
+        }
+
+        // the mapping is shared, so it sees our writes; only the size and the
+        // tree change with structural patches
+        void reindex()
+        {
+            _file = mapped_file_t{_path};
+            byte_reader_t reader{_file};
+            BasicAtomWalker<byte_reader_t> walker{reader};
+            while (walker.next())
+                ;
+            _nodes = std::move(walker.nodes);
+        }
+
+        std::string _path;
+        int _fd;
+        mapped_file_t _file;
+        std::vector<AtomNode> _nodes; // [0] is the whole file
+        uint64_t _bytes_written = 0;
+    };
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ---------------------- in-memory byte sources --------------------------
+
+namespace my_remux::mp4
+{
+    // non-owning view on a contiguous range of bytes
+    struct byte_span_t
+    {
+        const char* data = nullptr;
+        size_t size = 0;
+
+        const char* begin() const
+        {
+            return data;
+        }
+        const char* end() const
+        {
+            return data + size;
+        }
+        bool contains(size_t offset, size_t length) const
+        {
+            return offset <= size && length <= size - offset;
+        }
+        byte_span_t subspan(size_t offset, size_t length) const
+        {
+            if (!contains(offset, length))
+                throw std::out_of_range{"byte_span_t: subspan out of range"};
+            return byte_span_t{data + offset, length};
+        }
+    };
+
+    // read-only memory mapping of a whole file
+    class mapped_file_t
+    {
+    public:
+        mapped_file_t() = default;
+
+        explicit mapped_file_t(const std::string& path)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                throw std::runtime_error{"mapped_file_t: could not open '" + path + "'"};
+            struct stat st;
+            if (::fstat(fd, &st) != 0)
+            {
+                ::close(fd);
+                throw std::runtime_error{"mapped_file_t: could not stat '" + path + "'"};
+            }
+            _size = size_t(st.st_size);
+            if (_size > 0)
+            {
+                void* p = ::mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+                if (p == MAP_FAILED)
+                {
+                    ::close(fd);
+                    throw std::runtime_error{"mapped_file_t: could not map '" + path + "'"};
+                }
+                // we parse front to back, let the kernel read ahead aggressively
+                ::madvise(p, _size, MADV_SEQUENTIAL);
+                _data = static_cast<const char*>(p);
+            }
+            ::close(fd);
+        }
+
+        mapped_file_t(const mapped_file_t&) = delete;
+        mapped_file_t& operator=(const mapped_file_t&) = delete;
+
+        mapped_file_t(mapped_file_t&& other)
+        : _data{std::exchange(other._data, nullptr)}
+        , _size{std::exchange(other._size, 0)}
+        {
+        }
+
+        mapped_file_t& operator=(mapped_file_t&& other)
+        {
+            std::swap(_data, other._data);
+            std::swap(_size, other._size);
+            return *this;
+        }
+
+        ~mapped_file_t()
+        {
+            if (_data)
+                ::munmap(const_cast<char*>(_data), _size);
+        }
+
+        byte_span_t span() const
+        {
+            return byte_span_t{_data, _size};
+        }
+
+        const char* data() const
+        {
+            return _data;
+        }
+
+        size_t size() const
+        {
+            return _size;
+        }
+
+    private:
+        const char* _data = nullptr;
+        size_t _size = 0;
+    };
+
+    // cursor over a byte span with the subset of the std::istream interface
+    // the read_* parsers use, so they can run straight against memory.
+    // it is cheap to copy, so every thread can have its own cursor on a
+    // shared mapping.
+    class byte_reader_t
+    {
+    public:
+        explicit byte_reader_t(byte_span_t span)
+        : _span{span}
+        {
+        }
+
+        explicit byte_reader_t(const mapped_file_t& file)
+        : _span{file.span()}
+        {
+        }
+
+        void seekg(size_t offset)
+        {
+            _pos = offset;
+        }
+
+        size_t tellg() const
+        {
+            return _pos;
+        }
+
+        size_t size() const
+        {
+            return _span.size;
+        }
+
+        byte_span_t span() const
+        {
+            return _span;
+        }
+
+        // returns a pointer to the next n bytes and advances past them
+        const char* take(size_t n)
+        {
+            auto p = at(_pos, n);
+            _pos += n;
+            return p;
+        }
+
+        // returns a pointer to n bytes at offset without moving the cursor
+        const char* at(size_t offset, size_t n) const
+        {
+            if (!_span.contains(offset, n))
+                throw std::out_of_range{"byte_reader_t: read past end of data"};
+            return _span.data + offset;
+        }
+
+        int get()
+        {
+            return static_cast<unsigned char>(*take(1));
+        }
+
+        void read(char* out, size_t n)
+        {
+            std::memcpy(out, take(n), n);
+        }
+
+    private:
+        byte_span_t _span;
+        size_t _pos = 0;
+    };
+}
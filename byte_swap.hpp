@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// ---------------------- bulk big endian decoding --------------------------
+// the sample tables (stsz, stco, co64, stts, ctts, stsc) are plain arrays of
+// big endian integers, so instead of decoding them one field at a time we
+// copy them in one go and byte swap whole vector registers.
+
+namespace my_remux::mp4
+{
+    namespace detail
+    {
+        inline uint32_t load_be32(const unsigned char* p)
+        {
+            return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+        }
+
+        inline uint64_t load_be64(const unsigned char* p)
+        {
+            return (uint64_t(load_be32(p)) << 32) | load_be32(p + 4);
+        }
+    }
+
+    // decodes n big endian 32 bit words from src into dst.
+    // src and dst may be the same memory (in place swap), but must not
+    // overlap otherwise.
+    inline void decode_be32(const void* src, uint32_t* dst, size_t n)
+    {
+        auto in = static_cast<const unsigned char*>(src);
+        auto out = reinterpret_cast<unsigned char*>(dst);
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i shuffle = _mm256_setr_epi8(
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+        );
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 4 * i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 4 * i), _mm256_shuffle_epi8(v, shuffle));
+        }
+#endif
+#if defined(__SSSE3__)
+        const __m128i shuffle128 = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 4 * i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * i), _mm_shuffle_epi8(v, shuffle128));
+        }
+#endif
+        for (; i < n; ++i)
+        {
+            uint32_t x = detail::load_be32(in + 4 * i);
+            std::memcpy(out + 4 * i, &x, 4);
+        }
+    }
+
+    // same as decode_be32 for 64 bit words
+    inline void decode_be64(const void* src, uint64_t* dst, size_t n)
+    {
+        auto in = static_cast<const unsigned char*>(src);
+        auto out = reinterpret_cast<unsigned char*>(dst);
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i shuffle = _mm256_setr_epi8(
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+        );
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 8 * i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 8 * i), _mm256_shuffle_epi8(v, shuffle));
+        }
+#endif
+#if defined(__SSSE3__)
+        const __m128i shuffle128 = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 8 * i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8 * i), _mm_shuffle_epi8(v, shuffle128));
+        }
+#endif
+        for (; i < n; ++i)
+        {
+            uint64_t x = detail::load_be64(in + 8 * i);
+            std::memcpy(out + 8 * i, &x, 8);
+        }
+    }
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "MP4Atom.hpp"
+#include "gop_index.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// ---------------------- edit list timeline --------------------------
+// the edit list maps the movie timeline, which players present, onto the
+// media timeline of a track, in which the sample times are given (iso
+// 14496-12 8.6.6). empty edits leave a gap, dwells (rate 0) hold one media
+// time, and a track without edit list maps time 0 onto time 0.
+
+namespace my_remux::mp4
+{
+    struct timeline_edit_t
+    {
+        static constexpr int64_t empty = -1;
+
+        int64_t movie_start; // movie time scale
+        int64_t movie_duration;
+        int64_t media_start; // media time scale, empty for a gap
+        bool dwell; // media_start is presented for the whole duration
+
+        bool is_empty() const
+        {
+            return media_start == empty;
+        }
+
+        int64_t movie_end() const
+        {
+            return movie_start + movie_duration;
+        }
+    };
+
+    class edit_timeline_t
+    {
+    public:
+        edit_timeline_t() = default;
+
+        // media_duration is the end of the media, e.g. the stts total. it
+        // resolves zero duration edits, which run to the end of the media.
+        edit_timeline_t(const std::vector<edit_t>& elst, uint32_t movie_scale, uint32_t media_scale, int64_t media_duration)
+        : _movie_scale{movie_scale}
+        , _media_scale{media_scale}
+        {
+            if (movie_scale == 0 || media_scale == 0)
+                throw std::invalid_argument{"edit_timeline_t: time scales have to be positive"};
+            auto to_movie = [&](int64_t media_time) {
+                return rescale(media_time, media_scale, movie_scale, rounding_t::up);
+            };
+            int64_t movie_time = 0;
+            if (elst.empty())
+                _edits.push_back({0, to_movie(media_duration), 0, false});
+            for (auto& edit : elst)
+            {
+                timeline_edit_t entry{movie_time, int64_t(edit.duration), int64_t(edit.start_offset), edit.rate.count() == 0};
+                if (entry.media_start < timeline_edit_t::empty)
+                    throw std::runtime_error{"edit_timeline_t: negative media time"};
+                if (entry.movie_duration == 0 && !entry.is_empty() && !entry.dwell)
+                    entry.movie_duration = to_movie(media_duration - entry.media_start);
+                if (entry.movie_duration <= 0)
+                    continue;
+                _edits.push_back(entry);
+                movie_time = entry.movie_end();
+            }
+            _movie_starts.reserve(_edits.size());
+            for (auto& edit : _edits)
+                _movie_starts.push_back(edit.movie_start);
+
+            // edits that show media, ordered by their media start, with the
+            // running maximum of their media ends for the reverse lookup
+            for (uint32_t i = 0; i < _edits.size(); ++i)
+                if (!_edits[i].is_empty())
+                    _by_media.push_back(i);
+            std::stable_sort(_by_media.begin(), _by_media.end(), [&](uint32_t a, uint32_t b) {
+                return _edits[a].media_start < _edits[b].media_start;
+            });
+            int64_t max_end = INT64_MIN;
+            for (auto i : _by_media)
+            {
+                _media_starts.push_back(_edits[i].media_start);
+                max_end = std::max(max_end, media_end(_edits[i]));
+                _max_media_ends.push_back(max_end);
+            }
+        }
+
+        edit_timeline_t(const trak_t& trak, uint32_t movie_scale)
+        : edit_timeline_t{trak.edts.elst, movie_scale, trak.mdia.mdhd.time_scale, trak.mdia.minf.stbl.stts.total()}
+        {
+        }
+
+        const std::vector<timeline_edit_t>& edits() const
+        {
+            return _edits;
+        }
+
+        uint32_t movie_scale() const
+        {
+            return _movie_scale;
+        }
+
+        uint32_t media_scale() const
+        {
+            return _media_scale;
+        }
+
+        // presentation length, in the movie time scale
+        int64_t duration() const
+        {
+            return _edits.empty() ? 0 : _edits.back().movie_end();
+        }
+
+        // index of the edit presented at movie_time
+        std::optional<uint32_t> edit_at(int64_t movie_time) const
+        {
+            if (movie_time < 0 || movie_time >= duration())
+                return std::nullopt;
+            auto it = std::upper_bound(_movie_starts.begin(), _movie_starts.end(), movie_time);
+            return uint32_t(it - _movie_starts.begin()) - 1;
+        }
+
+        // media time presented at movie_time; nothing in gaps and past the end
+        std::optional<int64_t> media_time(int64_t movie_time) const
+        {
+            auto edit = edit_at(movie_time);
+            if (!edit || _edits[*edit].is_empty())
+                return std::nullopt;
+            return media_time_in(_edits[*edit], movie_time);
+        }
+
+        // earliest movie time at which media_time is presented; nothing if
+        // the edits skip it
+        std::optional<int64_t> movie_time(int64_t media_time) const
+        {
+            std::optional<int64_t> result;
+            auto it = std::upper_bound(_media_starts.begin(), _media_starts.end(), media_time);
+            // edits starting later can't contain media_time, and the running
+            // maximum ends the scan at the first run of edits that all end
+            // before it, which is the previous edit unless edits overlap
+            for (auto i = size_t(it - _media_starts.begin()); i-- > 0 && _max_media_ends[i] > media_time;)
+            {
+                auto& edit = _edits[_by_media[i]];
+                if (media_time >= media_end(edit))
+                    continue;
+                auto movie = edit.movie_start + (edit.dwell ? 0 : rescale(media_time - edit.media_start, _media_scale, _movie_scale, rounding_t::down));
+                if (!result || movie < *result)
+                    result = movie;
+            }
+            return result;
+        }
+
+        // seeks on the movie timeline. a time in a gap seeks to the start
+        // of the next edit that shows media; past the end there is nothing.
+        std::optional<seek_result_t> seek(const gop_index_t& gops, int64_t movie_time, seek_mode_t mode = seek_mode_t::previous_key) const
+        {
+            auto edit = edit_at(std::max<int64_t>(movie_time, 0));
+            if (!edit)
+                return std::nullopt;
+            auto i = *edit;
+            while (i < _edits.size() && _edits[i].is_empty())
+                ++i;
+            if (i == _edits.size())
+                return std::nullopt;
+            auto media = i == *edit ? media_time_in(_edits[i], std::max<int64_t>(movie_time, 0)) : _edits[i].media_start;
+            return gops.seek(media, mode);
+        }
+
+    private:
+        int64_t media_time_in(const timeline_edit_t& edit, int64_t movie_time) const
+        {
+            if (edit.dwell)
+                return edit.media_start;
+            return edit.media_start + rescale(movie_time - edit.movie_start, _movie_scale, _media_scale, rounding_t::down);
+        }
+
+        // first media time after the edit; a dwell shows a single one
+        int64_t media_end(const timeline_edit_t& edit) const
+        {
+            if (edit.dwell)
+                return edit.media_start + 1;
+            return edit.media_start + rescale(edit.movie_duration, _movie_scale, _media_scale, rounding_t::up);
+        }
+
+        uint32_t _movie_scale = 1;
+        uint32_t _media_scale = 1;
+        std::vector<timeline_edit_t> _edits; // in movie order, without zero length edits
+        std::vector<int64_t> _movie_starts; // per edit
+        std::vector<uint32_t> _by_media; // edits showing media, by media start
+        std::vector<int64_t> _media_starts; // parallel to _by_media
+        std::vector<int64_t> _max_media_ends; // running maximum, parallel to _by_media
+    };
+}
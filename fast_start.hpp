@@ -0,0 +1,183 @@
+#pragma once
+
+#include "MP4Atom.hpp"
+#include "sample_index.hpp"
+#include "output_segments.hpp"
+#include "interleave.hpp"
+
+#include <algorithm>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+// ---------------------- progressive download writing --------------------------
+
+namespace my_remux::mp4
+{
+    // end of the last sample relative to the chunk offset origin
+    inline uint64_t mdat_payload_size(const stbl_t& stbl)
+    {
+        sample_index_t index{stbl, sample_index_layout_t::compact};
+        uint64_t end = 0;
+        for (uint32_t sample = 0; sample < index.size(); ++sample)
+            end = std::max(end, index.offset(sample) + index.size(sample));
+        return end;
+    }
+
+    inline uint64_t mdat_payload_size(const moov_t& moov)
+    {
+        uint64_t end = 0;
+        for (auto& trak : moov.traks)
+            end = std::max(end, mdat_payload_size(trak.mdia.minf.stbl));
+        return end;
+    }
+
+    // writes ftyp, moov and the mdat header for a progressive download file.
+    // the chunk offsets of all tracks are taken relative to the start of the
+    // mdat payload and are shifted in place by the final header size, picking
+    // stco or co64 as the offsets require. returns the mdat payload size.
+    inline uint64_t write_fast_start_header(std::vector<char>& out, moov_t& moov, const ftyp_t& ftyp = {})
+    {
+        auto payload_size = mdat_payload_size(moov);
+        auto ftyp_size = size_of_ftyp(ftyp);
+        size_t mdat_header_size = payload_size + 8 > UINT32_MAX ? 16 : 8;
+        // the moov size depends on the offsets only through the stco/co64
+        // choice, which can only switch once, so this settles after at most
+        // three rounds
+        std::vector<std::vector<uint64_t>> relative;
+        for (auto& trak : moov.traks)
+            relative.push_back(trak.mdia.minf.stbl.co64);
+        size_t moov_size = 0;
+        for (;;)
+        {
+            uint64_t base = out.size() + ftyp_size + moov_size + mdat_header_size;
+            for (size_t track = 0; track < moov.traks.size(); ++track)
+            {
+                auto& co64 = moov.traks[track].mdia.minf.stbl.co64;
+                for (size_t i = 0; i < co64.size(); ++i)
+                    co64[i] = relative[track][i] + base;
+            }
+            auto new_moov_size = size_of_moov(moov);
+            if (new_moov_size == moov_size)
+                break;
+            moov_size = new_moov_size;
+        }
+        reserve_more(out, ftyp_size + moov_size + mdat_header_size);
+        write_ftyp(out, ftyp);
+        write_moov(out, moov);
+        if (mdat_header_size == 8)
+        {
+            put_number(uint32_t(8 + payload_size), out);
+            put_fourcc("mdat", out);
+        }
+        else
+        {
+            put_number(uint32_t(1), out);
+            put_fourcc("mdat", out);
+            put_number(uint64_t(16 + payload_size), out);
+        }
+        return payload_size;
+    }
+
+    // writes the fast start header up front, so players can start before
+    // the whole file is there, then lets the caller stream the mdat payload
+    // straight after, so the file is written exactly once.
+    class fast_start_writer_t
+    {
+    public:
+        fast_start_writer_t(std::ostream& out, moov_t moov, const ftyp_t& ftyp = {})
+        : _out{out}
+        , _moov{std::move(moov)}
+        {
+            std::vector<char> head;
+            _payload_size = write_fast_start_header(head, _moov, ftyp);
+            _payload_offset = head.size();
+            _out.write(head.data(), head.size());
+        }
+
+        // appends mdat payload
+        void write(const char* data, size_t size)
+        {
+            if (_written + size > _payload_size)
+                throw std::runtime_error{"fast_start_writer_t: more payload than announced by the sample tables"};
+            _out.write(data, size);
+            _written += size;
+        }
+
+        void finish()
+        {
+            if (_written != _payload_size)
+                throw std::runtime_error{"fast_start_writer_t: less payload than announced by the sample tables"};
+            _out.flush();
+        }
+
+        // file offset of the first payload byte
+        uint64_t payload_offset() const
+        {
+            return _payload_offset;
+        }
+
+        uint64_t payload_size() const
+        {
+            return _payload_size;
+        }
+
+        uint64_t written() const
+        {
+            return _written;
+        }
+
+        // the moov as written, with absolute chunk offsets
+        const moov_t& moov() const
+        {
+            return _moov;
+        }
+
+    private:
+        std::ostream& _out;
+        moov_t _moov;
+        uint64_t _payload_size = 0;
+        uint64_t _payload_offset = 0;
+        uint64_t _written = 0;
+    };
+
+    // where the samples of one output track come from
+    struct track_source_t
+    {
+        const sample_index_t* index;
+        int fd;
+    };
+
+    // remuxes the samples of source files into a fast start file without
+    // copying their payload: the result is the serialized header followed by
+    // references to the sources. moov describes the output tracks, their stsz
+    // has to match the sources sample by sample and their stsc defines the
+    // output chunking (see chunk_by_time); chunks are interleaved by time and
+    // the chunk offsets are recomputed.
+    inline segment_list_t fast_start_segments(moov_t moov, const std::vector<track_source_t>& sources, const ftyp_t& ftyp = {})
+    {
+        if (sources.size() != moov.traks.size())
+            throw std::runtime_error{"fast_start_segments: track count mismatch"};
+        for (size_t track = 0; track < sources.size(); ++track)
+            if (moov.traks[track].mdia.minf.stbl.stsz.size() != sources[track].index->size())
+                throw std::runtime_error{"fast_start_segments: sample count mismatch"};
+        auto order = interleaved_chunk_order(moov);
+        layout_chunks(moov, order);
+        std::vector<char> head;
+        write_fast_start_header(head, moov, ftyp);
+        segment_list_t segments;
+        segments.append(std::move(head));
+        for (auto& chunk : order)
+        {
+            auto& source = sources[chunk.track];
+            for (auto i = chunk.first_sample; i < chunk.first_sample + chunk.sample_count; ++i)
+                segments.append(file_range_t{source.fd, source.index->offset(i), source.index->size(i)});
+        }
+        return segments;
+    }
+
+    inline segment_list_t fast_start_segments(moov_t moov, const sample_index_t& source, int source_fd, const ftyp_t& ftyp = {})
+    {
+        return fast_start_segments(std::move(moov), {track_source_t{&source, source_fd}}, ftyp);
+    }
+}
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <limits>
+#include <stdexcept>
 #include <type_traits>
 #include <cstdlib>
 
@@ -23,16 +27,342 @@ constexpr uint32_t common_base(uint32_t base_v, uint32_t other_base_v)
     return base_v * (other_base_v / d);
 }
 
+enum class rounding_t
+{
+    toward_zero, // what integer division does
+    down,
+    up,
+    nearest, // halves away from zero
+};
+
+namespace fixed_point_detail
+{
+    // n / d for d > 0
+    template<typename int_t>
+    constexpr int_t divide(int_t n, int_t d, rounding_t rounding)
+    {
+        auto q = n / d;
+        auto r = n % d;
+        if (r == 0)
+            return q;
+        switch (rounding)
+        {
+        case rounding_t::toward_zero: return q;
+        case rounding_t::down: return n < 0 ? q - 1 : q;
+        case rounding_t::up: return n < 0 ? q : q + 1;
+        case rounding_t::nearest:
+        {
+            auto magnitude = r < 0 ? -r : r;
+            if (magnitude < d - magnitude)
+                return q;
+            return n < 0 ? q - 1 : q + 1;
+        }
+        }
+        return q;
+    }
+
+    template<typename count_t>
+    constexpr count_t narrow(__int128 value)
+    {
+        if (value < __int128(std::numeric_limits<count_t>::min()) || value > __int128(std::numeric_limits<count_t>::max()))
+            throw std::overflow_error{"rescale: result does not fit the count type"};
+        return count_t(value);
+    }
+}
+
+// unsigned 64 bit division by an invariant divisor as a multiply and
+// shifts (granlund and montgomery, in the form libdivide uses). divisors
+// whose reciprocal needs 65 bits get an extra add step.
+class reciprocal_divider_t
+{
+public:
+    constexpr reciprocal_divider_t() = default;
+
+    constexpr explicit reciprocal_divider_t(uint64_t divisor)
+    : _divisor{divisor}
+    {
+        if (divisor == 0)
+            throw std::invalid_argument{"reciprocal_divider_t: division by zero"};
+        _shift = uint8_t(63 - __builtin_clzll(divisor));
+        if ((divisor & (divisor - 1)) == 0)
+            return; // a plain shift
+        auto numerator = (unsigned __int128)(1) << (64 + _shift);
+        auto magic = uint64_t(numerator / divisor);
+        auto remainder = uint64_t(numerator % divisor);
+        if (divisor - remainder < (uint64_t(1) << _shift))
+        {
+            _magic = magic + 1;
+            return;
+        }
+        magic += magic;
+        auto twice_remainder = remainder + remainder;
+        if (twice_remainder >= divisor || twice_remainder < remainder)
+            magic += 1;
+        _magic = magic + 1;
+        _add = true;
+    }
+
+    constexpr uint64_t divisor() const
+    {
+        return _divisor;
+    }
+
+    constexpr uint64_t divide(uint64_t n) const
+    {
+        if (_magic == 0)
+            return n >> _shift;
+        auto high = uint64_t(((unsigned __int128)(n) * _magic) >> 64);
+        if (_add)
+            return (((n - high) >> 1) + high) >> _shift;
+        return high >> _shift;
+    }
+
+private:
+    uint64_t _divisor = 1;
+    uint64_t _magic = 0; // 0 for powers of two
+    uint8_t _shift = 0;
+    bool _add = false;
+};
+
+// count * to_timebase / from_timebase without intermediate overflow. the
+// product is formed in 64 bits when it fits and in 128 bits otherwise;
+// a result that does not fit count_t throws std::overflow_error.
+// timebases have to be positive and below 2^63.
+template<typename count_t>
+constexpr count_t rescale(count_t count, uint64_t from_timebase, uint64_t to_timebase, rounding_t rounding = rounding_t::toward_zero)
+{
+    static_assert(std::is_integral_v<count_t>);
+    if (from_timebase == to_timebase)
+        return count;
+    int64_t product = 0;
+    if (int64_t(count) == __int128(count) && to_timebase <= uint64_t(INT64_MAX) && from_timebase <= uint64_t(INT64_MAX) &&
+        !__builtin_mul_overflow(int64_t(count), int64_t(to_timebase), &product))
+    {
+        return fixed_point_detail::narrow<count_t>(fixed_point_detail::divide(product, int64_t(from_timebase), rounding));
+    }
+    return fixed_point_detail::narrow<count_t>(fixed_point_detail::divide(__int128(count) * to_timebase, __int128(from_timebase), rounding));
+}
+
+// a reduced from -> to timebase ratio with its divisor precomputed, for
+// rescaling many values between the same two timebases: a conversion is a
+// 64 bit multiply, the reciprocal multiply and the rounding fix up, with
+// the 128 bit path of rescale only for products beyond 64 bits.
+class timebase_ratio_t
+{
+public:
+    constexpr timebase_ratio_t() = default;
+
+    constexpr timebase_ratio_t(uint64_t from_timebase, uint64_t to_timebase)
+    : _from_timebase{from_timebase}
+    , _to_timebase{to_timebase}
+    , _from{from_timebase}
+    , _to{to_timebase}
+    {
+        if (from_timebase == 0 || to_timebase == 0)
+            throw std::invalid_argument{"timebase_ratio_t: timebases have to be positive"};
+        auto common = gcd(from_timebase, to_timebase);
+        _from /= common;
+        _to /= common;
+        _divider = reciprocal_divider_t{_from};
+    }
+
+    // the timebases as given
+    constexpr uint64_t from_timebase() const
+    {
+        return _from_timebase;
+    }
+
+    constexpr uint64_t to_timebase() const
+    {
+        return _to_timebase;
+    }
+
+    // the reduced ratio
+    constexpr uint64_t from() const
+    {
+        return _from;
+    }
+
+    constexpr uint64_t to() const
+    {
+        return _to;
+    }
+
+    template<typename count_t>
+    constexpr count_t apply(count_t count, rounding_t rounding = rounding_t::toward_zero) const
+    {
+        static_assert(std::is_integral_v<count_t>);
+        bool negative = is_negative(count);
+        uint64_t product = 0;
+        if (__builtin_mul_overflow(magnitude(count), _to, &product))
+            return rescale(count, _from, _to, rounding);
+        uint64_t q = 0;
+        switch (rounding)
+        {
+        case rounding_t::toward_zero: q = quotient<rounding_t::toward_zero>(product, negative); break;
+        case rounding_t::down: q = quotient<rounding_t::down>(product, negative); break;
+        case rounding_t::up: q = quotient<rounding_t::up>(product, negative); break;
+        case rounding_t::nearest: q = quotient<rounding_t::nearest>(product, negative); break;
+        }
+        if (q > uint64_t(std::numeric_limits<count_t>::max()) + negative)
+            throw std::overflow_error{"rescale: result does not fit the count type"};
+        return negative ? count_t(uint64_t(0) - q) : count_t(q);
+    }
+
+    // apply without range checks, for loops that checked their whole input:
+    // |count| * to() has to fit 64 bits and the result count_t
+    template<rounding_t rounding, typename count_t>
+    constexpr count_t apply_in_range(count_t count) const
+    {
+        bool negative = is_negative(count);
+        auto q = quotient<rounding>(magnitude(count) * _to, negative);
+        return negative ? count_t(uint64_t(0) - q) : count_t(q);
+    }
+
+    template<typename count_t>
+    static constexpr bool is_negative(count_t count)
+    {
+        if constexpr (std::is_signed_v<count_t>)
+            return count < 0;
+        else
+            return false;
+    }
+
+    template<typename count_t>
+    static constexpr uint64_t magnitude(count_t count)
+    {
+        return is_negative(count) ? uint64_t(0) - uint64_t(int64_t(count)) : uint64_t(count);
+    }
+
+private:
+    // product / from, with the magnitude rounded away from zero where the
+    // mode asks for it
+    template<rounding_t rounding>
+    constexpr uint64_t quotient(uint64_t product, bool negative) const
+    {
+        auto q = _divider.divide(product);
+        auto r = product - q * _from;
+        if constexpr (rounding == rounding_t::down)
+            return q + (negative && r != 0);
+        else if constexpr (rounding == rounding_t::up)
+            return q + (!negative && r != 0);
+        else if constexpr (rounding == rounding_t::nearest)
+            return q + (r != 0 && r >= _from - r);
+        else
+            return q;
+    }
+
+    uint64_t _from_timebase = 1;
+    uint64_t _to_timebase = 1;
+    uint64_t _from = 1;
+    uint64_t _to = 1;
+    reciprocal_divider_t _divider;
+};
+
+namespace fixed_point_detail
+{
+    template<rounding_t rounding, typename count_t>
+    void rescale_in_range(const count_t* in, count_t* out, size_t n, const timebase_ratio_t& ratio)
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = ratio.apply_in_range<rounding>(in[i]);
+    }
+}
+
+// rescales n timestamps from in to out, which may be the same array. the
+// ratio is set up and the input range checked once, so the loop is a
+// multiply, the reciprocal multiply and the rounding fix up per value, and
+// a plain multiply for integer factors. inputs that could overflow 64 bits
+// fall back to the checked path per value.
+// the loop is scalar: the reciprocal multiply takes the high half of a
+// 64x64 bit product, which x86 vector units can't form (gcc emulates it
+// from 32 bit multiplies only at -O3 with avx2). an exact double loop for
+// products below 2^51 vectorizes, but measured no faster than this one.
+template<typename count_t>
+void rescale_span(const count_t* in, count_t* out, size_t n, uint64_t from_timebase, uint64_t to_timebase, rounding_t rounding = rounding_t::toward_zero)
+{
+    static_assert(std::is_integral_v<count_t>);
+    timebase_ratio_t ratio{from_timebase, to_timebase};
+    if (ratio.from() == 1 && ratio.to() == 1)
+    {
+        if (in != out)
+            std::copy(in, in + n, out);
+        return;
+    }
+    if (n == 0)
+        return;
+    auto [low, high] = std::minmax_element(in, in + n);
+    auto largest = std::max(timebase_ratio_t::magnitude(*low), timebase_ratio_t::magnitude(*high));
+    // rounded up, the result magnitude is at most ceil(largest * to / from)
+    auto bound = ((unsigned __int128)(largest) * ratio.to() + ratio.from() - 1) / ratio.from();
+    if (largest > UINT64_MAX / ratio.to() || bound > uint64_t(std::numeric_limits<count_t>::max()))
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = ratio.apply(in[i], rounding);
+        return;
+    }
+    if (ratio.from() == 1)
+    {
+        auto factor = count_t(ratio.to());
+        for (size_t i = 0; i < n; ++i)
+            out[i] = in[i] * factor;
+        return;
+    }
+    switch (rounding)
+    {
+    case rounding_t::toward_zero: fixed_point_detail::rescale_in_range<rounding_t::toward_zero>(in, out, n, ratio); break;
+    case rounding_t::down: fixed_point_detail::rescale_in_range<rounding_t::down>(in, out, n, ratio); break;
+    case rounding_t::up: fixed_point_detail::rescale_in_range<rounding_t::up>(in, out, n, ratio); break;
+    case rounding_t::nearest: fixed_point_detail::rescale_in_range<rounding_t::nearest>(in, out, n, ratio); break;
+    }
+}
+
+// truncates toward zero, like the plain integer expression it replaces
 template<typename count_t> count_t change_timebase(
     count_t count,
     uint32_t from_timebase,
     uint32_t to_timebase
 )
 {
-    auto common = gcd(from_timebase, to_timebase);
-    from_timebase /= common;
-    to_timebase /= common;
-    return (count * to_timebase) / from_timebase;
+    return rescale(count, from_timebase, to_timebase);
+}
+
+// reduced ratio of two timebases known at compile time
+template<uint64_t from_v, uint64_t to_v>
+struct static_timebase_ratio_t
+{
+    static_assert(from_v > 0 && to_v > 0, "timebases have to be positive");
+    static constexpr uint64_t common = gcd(from_v, to_v);
+    static constexpr uint64_t from = from_v / common;
+    static constexpr uint64_t to = to_v / common;
+};
+
+// rescale between compile time timebases. the ratio is reduced at compile
+// time, so 90000 -> 1000000000 is a multiply by 100000 / 9 and 90000 -> 1000
+// a division by 90, which the compiler turns into a multiply and shifts.
+// same results and overflow checks as rescale.
+template<uint64_t from_v, uint64_t to_v, typename count_t>
+constexpr count_t static_rescale(count_t count, rounding_t rounding = rounding_t::toward_zero)
+{
+    static_assert(std::is_integral_v<count_t>);
+    using ratio = static_timebase_ratio_t<from_v, to_v>;
+    if constexpr (ratio::from == 1 && ratio::to == 1)
+    {
+        return count;
+    }
+    else
+    {
+        static_assert(ratio::to <= uint64_t(INT64_MAX) && ratio::from <= uint64_t(INT64_MAX));
+        int64_t product = 0;
+        if (int64_t(count) == __int128(count) && !__builtin_mul_overflow(int64_t(count), int64_t(ratio::to), &product))
+        {
+            if constexpr (ratio::from == 1)
+                return fixed_point_detail::narrow<count_t>(product);
+            else
+                return fixed_point_detail::narrow<count_t>(fixed_point_detail::divide(product, int64_t(ratio::from), rounding));
+        }
+        return fixed_point_detail::narrow<count_t>(fixed_point_detail::divide(__int128(count) * ratio::to, __int128(ratio::from), rounding));
+    }
 }
 
 template<uint32_t base_v, typename count_t = int64_t>
@@ -47,12 +377,12 @@ public:
     }
 
     template<uint32_t other_base_v, typename other_count_t>
-    explicit fixed_point_t(fixed_point_t<other_base_v, other_count_t> other)
-    : _count(change_timebase(other.count(), other_base_v, base_v))
+    constexpr explicit fixed_point_t(fixed_point_t<other_base_v, other_count_t> other)
+    : _count(count_t(static_rescale<other_base_v, base_v>(other.count())))
     {
     }
 
-    static this_t with_count(count_t count)
+    static constexpr this_t with_count(count_t count)
     {
         this_t result;
         result._count = count;
@@ -74,7 +404,7 @@ public:
         return change_timebase(count(), base_v, to_timebase);
     }
 
-    fixed_point_t()
+    constexpr fixed_point_t()
     : _count{0}
     {
     }
@@ -97,7 +427,7 @@ public:
     template<uint32_t other_base_v>
     this_t& operator=(const fixed_point_t<other_base_v>& other)
     {
-        _count = (other.count() * base_v) / other_base_v;
+        _count = count_t(static_rescale<other_base_v, base_v>(other.count()));
         return *this;
     }
 
@@ -198,14 +528,14 @@ public:
         return do_cmp_op(other, [](auto a, auto b){return a != b;});
     }
 
-    count_t count() const
+    constexpr count_t count() const
     {
         return _count;
     }
 
     count_t to_timebase(uint32_t timebase) const
     {
-        return (_count * timebase) / base_v;
+        return change_timebase(_count, base_v, timebase);
     }
 
 private:
@@ -301,8 +631,21 @@ public:
 
     count_t rebased_count(base_t new_base) const
     {
-        auto divisor = gcd(new_base, base());
-        return (_count * (new_base / divisor)) / (base() / divisor);
+        return rescale(_count, base(), new_base);
+    }
+
+    // for converting many values between the same timebases: the ratio is
+    // set up once, outside the loop, and has to start at base()
+    runtime_fixed_point_t in_timebase(const timebase_ratio_t& ratio) const
+    {
+        return {rebased_count(ratio), base_t(ratio.to_timebase())};
+    }
+
+    count_t rebased_count(const timebase_ratio_t& ratio) const
+    {
+        if (ratio.from_timebase() != base())
+            throw std::invalid_argument{"runtime_fixed_point_t: ratio for a different timebase"};
+        return ratio.apply(_count);
     }
 
     explicit operator float() const
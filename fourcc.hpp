@@ -0,0 +1,215 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// ---------------------- four character codes --------------------------
+
+namespace my_remux::mp4
+{
+    // atom type with the same in memory representation as MP4Atom::type,
+    // i.e. the four characters in file order loaded as a host integer.
+    struct fourcc_t
+    {
+        uint32_t value = 0;
+
+        constexpr fourcc_t() = default;
+
+        constexpr explicit fourcc_t(uint32_t raw)
+        : value{raw}
+        {
+        }
+
+        constexpr fourcc_t(const char* type)
+        : value{pack(type)}
+        {
+        }
+
+        std::string str() const
+        {
+            char chars[4] = {
+                char(byte(0)),
+                char(byte(1)),
+                char(byte(2)),
+                char(byte(3)),
+            };
+            return std::string(chars, 4);
+        }
+
+        // i-th character in file order
+        constexpr uint8_t byte(size_t i) const
+        {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return uint8_t(value >> (8 * (3 - i)));
+#else
+            return uint8_t(value >> (8 * i));
+#endif
+        }
+
+        constexpr bool operator==(fourcc_t other) const
+        {
+            return value == other.value;
+        }
+
+        constexpr bool operator!=(fourcc_t other) const
+        {
+            return value != other.value;
+        }
+
+    private:
+        static constexpr uint32_t pack(const char* t)
+        {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return (uint32_t(uint8_t(t[0])) << 24) | (uint32_t(uint8_t(t[1])) << 16) |
+                   (uint32_t(uint8_t(t[2])) << 8) | uint32_t(uint8_t(t[3]));
+#else
+            return uint32_t(uint8_t(t[0])) | (uint32_t(uint8_t(t[1])) << 8) |
+                   (uint32_t(uint8_t(t[2])) << 16) | (uint32_t(uint8_t(t[3])) << 24);
+#endif
+        }
+    };
+
+    namespace literals
+    {
+        constexpr fourcc_t operator""_4cc(const char* type, size_t length)
+        {
+            return length == 4 ? fourcc_t{type} : throw std::invalid_argument{"fourcc literals need four characters"};
+        }
+    }
+
+    // ---------------------- box type dispatch --------------------------
+
+    enum class box_parser_t : uint8_t
+    {
+        none,
+        mvhd,
+        tkhd,
+        mdhd,
+        elst,
+        stts,
+        ctts,
+        stss,
+        stsc,
+        stsz,
+        stco,
+        co64,
+        avcC,
+        hvcC,
+        esds,
+        hdlr,
+        mfhd,
+        tfhd,
+        tfdt,
+        trun,
+    };
+
+    struct box_type_info_t
+    {
+        fourcc_t type;
+        bool is_container;
+        uint8_t child_offset; // bytes between content start and first child
+        box_parser_t parser;
+    };
+
+    inline constexpr box_type_info_t box_types[] = {
+        {"moov", true, 0, box_parser_t::none},
+        {"moof", true, 0, box_parser_t::none},
+        {"trak", true, 0, box_parser_t::none},
+        {"traf", true, 0, box_parser_t::none},
+        {"mfra", true, 0, box_parser_t::none},
+        {"mvex", true, 0, box_parser_t::none},
+        {"mdia", true, 0, box_parser_t::none},
+        {"minf", true, 0, box_parser_t::none},
+        {"stbl", true, 0, box_parser_t::none},
+        {"stsd", true, 8, box_parser_t::none}, // uint32_t version_flags, uint32_t numChildren
+        {"file", true, 0, box_parser_t::none}, // pseudo atom
+        {"dinf", true, 0, box_parser_t::none},
+        {"dref", true, 8, box_parser_t::none}, // uint32_t version_flags, uint32_t numChildren
+        {"udta", true, 0, box_parser_t::none},
+        {"meta", true, 4, box_parser_t::none}, // uint32_t version_flags
+        {"ilst", true, 0, box_parser_t::none},
+        {"edts", true, 0, box_parser_t::none},
+        // 6 bytes pad & 2 bytes index
+        // version(2), revision(2), vendor(4),
+        // temp quality(4), spat quality(4),
+        // width(2), height(2), hppi(4), vppi(4)
+        // data size(4, always 0)
+        // frame count(2)
+        // compressor name(32)
+        // depth(2)
+        // color table id (2)
+        {"avc1", true, 78, box_parser_t::none},
+        {"hvc1", true, 78, box_parser_t::none}, // same layout as avc1
+        {"hev1", true, 78, box_parser_t::none},
+        {"mp4a", true, 28, box_parser_t::none}, // audio sample entry
+        {"mvhd", false, 0, box_parser_t::mvhd},
+        {"tkhd", false, 0, box_parser_t::tkhd},
+        {"mdhd", false, 0, box_parser_t::mdhd},
+        {"elst", false, 0, box_parser_t::elst},
+        {"stts", false, 0, box_parser_t::stts},
+        {"ctts", false, 0, box_parser_t::ctts},
+        {"stss", false, 0, box_parser_t::stss},
+        {"stsc", false, 0, box_parser_t::stsc},
+        {"stsz", false, 0, box_parser_t::stsz},
+        {"stco", false, 0, box_parser_t::stco},
+        {"co64", false, 0, box_parser_t::co64},
+        {"avcC", false, 0, box_parser_t::avcC},
+        {"hvcC", false, 0, box_parser_t::hvcC},
+        {"esds", false, 0, box_parser_t::esds},
+        {"hdlr", false, 0, box_parser_t::hdlr},
+        {"mfhd", false, 0, box_parser_t::mfhd},
+        {"tfhd", false, 0, box_parser_t::tfhd},
+        {"tfdt", false, 0, box_parser_t::tfdt},
+        {"trun", false, 0, box_parser_t::trun},
+    };
+
+    namespace detail
+    {
+        constexpr size_t box_type_hash_bits = 7;
+
+        constexpr size_t box_type_hash(fourcc_t type)
+        {
+            return size_t((type.value * 0x9e3779b1u) >> (32 - box_type_hash_bits));
+        }
+
+        // open addressing hash table over box_types, built at compile time.
+        // slots hold an index into box_types, or -1 when empty.
+        constexpr auto make_box_type_slots()
+        {
+            std::array<int8_t, size_t(1) << box_type_hash_bits> slots{};
+            for (auto& slot : slots)
+                slot = -1;
+            for (size_t i = 0; i < std::size(box_types); ++i)
+            {
+                auto slot = box_type_hash(box_types[i].type);
+                while (slots[slot] != -1)
+                    slot = (slot + 1) % slots.size();
+                slots[slot] = int8_t(i);
+            }
+            return slots;
+        }
+
+        inline constexpr auto box_type_slots = make_box_type_slots();
+    }
+
+    // static information about a box type, nullptr for unknown types
+    constexpr const box_type_info_t* find_box_type(fourcc_t type)
+    {
+        auto slot = detail::box_type_hash(type);
+        while (detail::box_type_slots[slot] != -1)
+        {
+            auto& info = box_types[detail::box_type_slots[slot]];
+            if (info.type == type)
+                return &info;
+            slot = (slot + 1) % detail::box_type_slots.size();
+        }
+        return nullptr;
+    }
+
+    static_assert(find_box_type("stsd")->child_offset == 8);
+    static_assert(find_box_type("trun")->parser == box_parser_t::trun);
+    static_assert(find_box_type("mdat") == nullptr);
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include "MP4Atom.hpp"
+#include "sample_index.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// ---------------------- fragmented file indexing --------------------------
+// long fragmented recordings have tens of thousands of moofs. they are found
+// with one pass over the top level box headers, then parsed in parallel over
+// the mapped file: every worker has its own byte_reader_t, so there is no
+// shared seek position.
+
+namespace my_remux::mp4
+{
+    // top level atoms of the given type, e.g. all moofs. only box headers
+    // are read, the pass jumps from box to box.
+    inline std::vector<MP4Atom> find_top_level_atoms(byte_span_t file, fourcc_t type)
+    {
+        std::vector<MP4Atom> atoms;
+        byte_reader_t reader{file};
+        size_t offset = 0;
+        while (file.size - offset >= 8)
+        {
+            // size 0 boxes extend to the end of the file, boxes past it throw
+            auto atom = readAtomAtOffset(reader, offset, file.size);
+            if (atom.isType(type))
+                atoms.push_back(atom);
+            offset = atom.endOffset();
+        }
+        return atoms;
+    }
+
+    // calls f(i) for i in [0, n) on up to thread_count threads (0: one per
+    // core). indices are handed out in small batches from a shared counter,
+    // so threads that get cheap items simply take more. the first exception
+    // thrown by f is rethrown once all threads are done.
+    template<typename F>
+    inline void parallel_for(size_t n, unsigned thread_count, F&& f)
+    {
+        if (thread_count == 0)
+            thread_count = std::max(1u, std::thread::hardware_concurrency());
+        thread_count = unsigned(std::min<size_t>(thread_count, n));
+        if (thread_count <= 1)
+        {
+            for (size_t i = 0; i < n; ++i)
+                f(i);
+            return;
+        }
+        // a few batches per thread keep the counter cold without losing balance
+        size_t batch = std::max<size_t>(1, n / (16 * thread_count));
+        std::atomic<size_t> next{0};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto work = [&] {
+            try
+            {
+                while (!failed.load(std::memory_order_relaxed))
+                {
+                    auto first = next.fetch_add(batch, std::memory_order_relaxed);
+                    if (first >= n)
+                        break;
+                    for (auto i = first; i < std::min(n, first + batch); ++i)
+                        f(i);
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock{error_mutex};
+                if (!error)
+                    error = std::current_exception();
+                failed = true;
+            }
+        };
+        std::vector<std::thread> threads;
+        threads.reserve(thread_count - 1);
+        for (unsigned i = 1; i < thread_count; ++i)
+            threads.emplace_back(work);
+        work();
+        for (auto& thread : threads)
+            thread.join();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // parses the given moof atoms of a mapped file in parallel
+    inline std::vector<moof_t> read_moofs(byte_span_t file, const std::vector<MP4Atom>& atoms, unsigned thread_count = 0)
+    {
+        std::vector<moof_t> moofs(atoms.size());
+        parallel_for(atoms.size(), thread_count, [&](size_t i) {
+            byte_reader_t reader{file};
+            moofs[i] = read_moof(reader, atoms[i]);
+        });
+        return moofs;
+    }
+
+    // samples of one track across all fragments, in decoding order
+    struct fragment_track_t
+    {
+        uint32_t track_id;
+        std::vector<sample_info_t> samples;
+    };
+
+    struct fragment_index_t
+    {
+        std::vector<fragment_track_t> tracks;
+
+        const fragment_track_t* find(uint32_t track_id) const
+        {
+            for (auto& track : tracks)
+                if (track.track_id == track_id)
+                    return &track;
+            return nullptr;
+        }
+    };
+
+    namespace detail
+    {
+        // samples of one traf. without tfdt the times are relative to the
+        // end of the track's previous fragment and get fixed up when merging.
+        struct traf_samples_t
+        {
+            uint32_t track_id;
+            bool has_tfdt;
+            int64_t end_dts;
+            std::vector<sample_info_t> samples;
+        };
+
+        inline const trex_t* find_trex(const mvex_t* mvex, uint32_t track_id)
+        {
+            if (mvex)
+                for (auto& trex : mvex->trex)
+                    if (trex.track_ID == track_id)
+                        return &trex;
+            return nullptr;
+        }
+
+        // resolves the defaults of tfhd and trex and the data offsets of a
+        // moof (iso 14496-12 8.8.7, 8.8.8)
+        inline std::vector<traf_samples_t> moof_samples(const moof_t& moof, const MP4Atom& atom, const mvex_t* mvex)
+        {
+            std::vector<traf_samples_t> result;
+            uint64_t moof_start = atom.headerOffset();
+            uint64_t previous_traf_end = moof_start;
+            for (auto& traf : moof.traf)
+            {
+                auto& tfhd = traf.tfhd;
+                auto trex = find_trex(mvex, tfhd.track_ID);
+                uint64_t base = tfhd.base_data_offset ? *tfhd.base_data_offset
+                              : tfhd.default_base_is_moof || result.empty() ? moof_start
+                              : previous_traf_end;
+                auto default_duration = tfhd.default_sample_duration.value_or(trex ? trex->default_sample_duration : 0);
+                auto default_size = tfhd.default_sample_size.value_or(trex ? trex->default_sample_size : 0);
+                auto default_flags = tfhd.default_sample_flags.value_or(trex ? trex->default_sample_flags : 0);
+                traf_samples_t samples{tfhd.track_ID, bool(traf.tfdt), 0, {}};
+                int64_t dts = traf.tfdt ? int64_t(traf.tfdt->base_media_decode_time) : 0;
+                uint64_t offset = base;
+                for (auto& trun : traf.trun)
+                {
+                    if (trun.data_offset)
+                        offset = base + *trun.data_offset;
+                    for (uint32_t i = 0; i < trun.samples.size(); ++i)
+                    {
+                        auto& sample = trun.samples[i];
+                        auto size = sample.size.value_or(default_size);
+                        auto flags = i == 0 && trun.first_sample_flags ? *trun.first_sample_flags : sample.flags.value_or(default_flags);
+                        samples.samples.push_back({
+                            offset,
+                            size,
+                            dts,
+                            dts + sample.composition_time_offset.value_or(0),
+                            is_sync_sample(flags),
+                        });
+                        offset += size;
+                        dts += sample.duration.value_or(default_duration);
+                    }
+                }
+                samples.end_dts = dts;
+                previous_traf_end = offset;
+                result.push_back(std::move(samples));
+            }
+            return result;
+        }
+    }
+
+    // indexes all samples of a fragmented file. moofs are located with one
+    // pass over the top level boxes, then parsed and resolved in parallel;
+    // the per fragment results are merged in file order. mvex supplies the
+    // trex defaults and can be omitted if every tfhd carries its own.
+    inline fragment_index_t build_fragment_index(byte_span_t file, const mvex_t* mvex = nullptr, unsigned thread_count = 0)
+    {
+        auto atoms = find_top_level_atoms(file, "moof");
+        std::vector<std::vector<detail::traf_samples_t>> fragments(atoms.size());
+        parallel_for(atoms.size(), thread_count, [&](size_t i) {
+            byte_reader_t reader{file};
+            fragments[i] = detail::moof_samples(read_moof(reader, atoms[i]), atoms[i], mvex);
+        });
+        fragment_index_t index;
+        std::vector<int64_t> track_end; // next dts per track, parallel to index.tracks
+        for (auto& fragment : fragments)
+        {
+            for (auto& traf : fragment)
+            {
+                auto it = std::find_if(index.tracks.begin(), index.tracks.end(), [&](const fragment_track_t& track) {
+                    return track.track_id == traf.track_id;
+                });
+                if (it == index.tracks.end())
+                {
+                    index.tracks.push_back({traf.track_id, {}});
+                    track_end.push_back(0);
+                    it = index.tracks.end() - 1;
+                }
+                auto& end = track_end[size_t(it - index.tracks.begin())];
+                int64_t shift = traf.has_tfdt ? 0 : end;
+                for (auto& sample : traf.samples)
+                {
+                    sample.dts += shift;
+                    sample.pts += shift;
+                }
+                end = traf.end_dts + shift;
+                it->samples.insert(it->samples.end(), traf.samples.begin(), traf.samples.end());
+            }
+        }
+        return index;
+    }
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "sample_index.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// ---------------------- gop table and seeking --------------------------
+// seeking has to start decoding at a keyframe. the table keeps one entry per
+// group of pictures, so a seek is a binary search over keyframes plus, for
+// frame exact seeks, a scan of one gop.
+
+namespace my_remux::mp4
+{
+    // a keyframe and the samples decoded after it up to the next keyframe.
+    // times are in the media time scale.
+    struct gop_t
+    {
+        uint32_t first_sample; // the keyframe
+        uint32_t sample_count;
+        int64_t dts; // of the keyframe
+        int64_t pts; // of the keyframe
+        uint64_t offset; // lowest byte of any sample
+        uint64_t end; // past the highest byte of any sample
+        uint64_t size; // sum of the sample sizes
+    };
+
+    enum class seek_mode_t
+    {
+        previous_key, // last keyframe presented at or before the time
+        nearest_key, // keyframe presented closest to the time
+        exact, // the sample presented at the time, decoded from previous_key
+    };
+
+    struct seek_result_t
+    {
+        uint32_t gop;
+        uint32_t decode_sample; // start decoding here
+        uint32_t present_sample; // first sample to show
+        int64_t pts; // of present_sample
+    };
+
+    class gop_index_t
+    {
+    public:
+        gop_index_t() = default;
+
+        // keyframes from stss; without stss every sample is one
+        explicit gop_index_t(const sample_index_t& index)
+        {
+            _pts.reserve(index.size());
+            for (uint32_t sample = 0; sample < index.size(); ++sample)
+                add(index.offset(sample), index.size(sample), index.dts(sample), index.pts(sample), index.is_keyframe(sample));
+        }
+
+        // samples of a fragmented track, keyframes from the sample flags
+        explicit gop_index_t(const std::vector<sample_info_t>& samples)
+        {
+            _pts.reserve(samples.size());
+            for (auto& sample : samples)
+                add(sample.offset, sample.size, sample.dts, sample.pts, sample.keyframe);
+        }
+
+        const std::vector<gop_t>& gops() const
+        {
+            return _gops;
+        }
+
+        uint32_t size() const
+        {
+            return uint32_t(_gops.size());
+        }
+
+        const gop_t& operator[](uint32_t gop) const
+        {
+            return _gops.at(gop);
+        }
+
+        // gop containing sample in decoding order. samples before the first
+        // keyframe belong to no gop and throw.
+        uint32_t gop_of(uint32_t sample) const
+        {
+            if (_gops.empty() || sample < _gops.front().first_sample || sample >= _pts.size())
+                throw std::out_of_range{"gop_index_t: sample not in any gop"};
+            auto it = std::upper_bound(_gops.begin(), _gops.end(), sample, [](uint32_t sample, const gop_t& gop) {
+                return sample < gop.first_sample;
+            });
+            return uint32_t(it - _gops.begin()) - 1;
+        }
+
+        // time is a presentation time in the media time scale. times before
+        // the first keyframe resolve to the first gop.
+        seek_result_t seek(int64_t time, seek_mode_t mode = seek_mode_t::previous_key) const
+        {
+            if (_gops.empty())
+                throw std::out_of_range{"gop_index_t: no keyframes"};
+            auto it = std::upper_bound(_key_pts.begin(), _key_pts.end(), time);
+            uint32_t gop = it == _key_pts.begin() ? 0 : uint32_t(it - _key_pts.begin()) - 1;
+            if (mode == seek_mode_t::nearest_key && gop + 1 < _gops.size() &&
+                _key_pts[gop + 1] - time < time - _key_pts[gop])
+                ++gop;
+            auto& key = _gops[gop];
+            if (mode != seek_mode_t::exact || time <= key.pts)
+                return {gop, key.first_sample, key.first_sample, key.pts};
+
+            // the latest sample presented at or before time. with open gops
+            // the leading pictures of the next gop can be that sample; they
+            // are decodable when decoding simply continues from this gop.
+            seek_result_t result{gop, key.first_sample, key.first_sample, key.pts};
+            auto last = key.first_sample + key.sample_count;
+            if (gop + 1 < _gops.size())
+                last += _gops[gop + 1].sample_count;
+            auto next_key_pts = gop + 1 < _gops.size() ? _key_pts[gop + 1] : INT64_MAX;
+            for (auto sample = key.first_sample; sample < last; ++sample)
+            {
+                auto pts = _pts[sample];
+                bool leading = sample >= key.first_sample + key.sample_count;
+                if (leading && pts >= next_key_pts)
+                    continue;
+                if (pts <= time && pts > result.pts)
+                {
+                    result.present_sample = sample;
+                    result.pts = pts;
+                }
+            }
+            return result;
+        }
+
+    private:
+        void add(uint64_t offset, uint32_t size, int64_t dts, int64_t pts, bool keyframe)
+        {
+            auto sample = uint32_t(_pts.size());
+            _pts.push_back(pts);
+            if (keyframe)
+            {
+                _gops.push_back({sample, 0, dts, pts, offset, offset, 0});
+                _key_pts.push_back(pts);
+            }
+            if (_gops.empty())
+                return;
+            auto& gop = _gops.back();
+            ++gop.sample_count;
+            gop.offset = std::min(gop.offset, offset);
+            gop.end = std::max(gop.end, offset + size);
+            gop.size += size;
+        }
+
+        std::vector<gop_t> _gops;
+        std::vector<int64_t> _key_pts; // per gop, for the binary search
+        std::vector<int64_t> _pts; // per sample, for exact seeks
+    };
+}
@@ -0,0 +1,452 @@
+#pragma once
+
+#include "MP4Atom.hpp"
+#include "sample_index.hpp"
+#include "fragment_index.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// ---------------------- sidecar index cache --------------------------
+// parsing moov and expanding the sample tables is repeated on every open of
+// an unchanged file. the sidecar stores the result as flat arrays that are
+// used straight from a read-only mapping: box tree, per track sample table
+// and the serialized stsd. all fields are host endian and naturally aligned;
+// the format version and a byte order mark reject foreign files.
+//
+// layout: index_cache_header_t, cached_box_t[box_count],
+// cached_track_t[track_count], then per track its cached_sample_t array and
+// its stsd box, each starting 8 byte aligned.
+
+namespace my_remux::mp4
+{
+    inline constexpr char index_cache_magic[8] = {'m', 'p', '4', 'i', 'd', 'x', 0, 0};
+    inline constexpr uint32_t index_cache_version = 1;
+    inline constexpr uint32_t index_cache_byte_order = 0x01020304;
+
+    // identifies the source file contents the sidecar was built from
+    struct index_cache_key_t
+    {
+        uint64_t file_size = 0;
+        int64_t mtime_ns = 0;
+        uint64_t moov_hash = 0; // fnv-1a of the whole moov box
+
+        bool operator==(const index_cache_key_t& other) const
+        {
+            return file_size == other.file_size && mtime_ns == other.mtime_ns && moov_hash == other.moov_hash;
+        }
+
+        bool operator!=(const index_cache_key_t& other) const
+        {
+            return !(*this == other);
+        }
+    };
+
+    struct index_cache_header_t
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        index_cache_key_t key;
+        uint32_t box_count;
+        uint32_t track_count;
+        uint64_t boxes_offset;
+        uint64_t tracks_offset;
+        uint64_t total_size;
+    };
+
+    struct cached_box_t
+    {
+        uint64_t offset; // of the header
+        uint64_t size; // including the header
+        uint32_t type; // as MP4Atom::type
+        uint32_t parent; // index, AtomNode::npos for top level boxes
+        uint32_t header_size;
+        uint32_t depth;
+    };
+
+    struct cached_track_t
+    {
+        uint32_t track_id;
+        uint32_t time_scale;
+        uint32_t handler_type; // as fourcc_t::value
+        uint32_t sample_count;
+        uint64_t samples_offset;
+        uint64_t stsd_offset;
+        uint64_t stsd_size;
+    };
+
+    struct cached_sample_t
+    {
+        static constexpr uint32_t keyframe = 0x1;
+
+        uint64_t offset;
+        uint32_t size;
+        uint32_t flags;
+        int64_t dts;
+        int64_t pts;
+    };
+
+    static_assert(std::is_trivially_copyable_v<index_cache_header_t> && sizeof(index_cache_header_t) == 72);
+    static_assert(sizeof(cached_box_t) == 32 && sizeof(cached_track_t) == 40 && sizeof(cached_sample_t) == 32);
+
+    inline uint64_t fnv1a_64(const char* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash ^= uint8_t(data[i]);
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    // key of a source file, given its mapping
+    inline index_cache_key_t index_cache_key(const std::string& path, byte_span_t file)
+    {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0)
+            throw std::system_error{errno, std::generic_category(), "index_cache_key: could not stat '" + path + "'"};
+        index_cache_key_t key;
+        key.file_size = uint64_t(st.st_size);
+        key.mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        auto moovs = find_top_level_atoms(file, "moov");
+        if (moovs.empty())
+            throw std::runtime_error{"index_cache_key: no moov atom"};
+        auto& moov = moovs.front();
+        key.moov_hash = fnv1a_64(file.data + moov.headerOffset(), moov.totalLength());
+        return key;
+    }
+
+    namespace detail
+    {
+        template<typename T>
+        inline void put_struct(std::vector<char>& out, const T& value)
+        {
+            auto p = reinterpret_cast<const char*>(&value);
+            out.insert(out.end(), p, p + sizeof(T));
+        }
+
+        inline void align_to_8(std::vector<char>& out)
+        {
+            out.resize((out.size() + 7) & ~size_t(7));
+        }
+
+        inline uint32_t find_child(const BasicAtomWalker<byte_reader_t>& walker, uint32_t parent, fourcc_t type)
+        {
+            for (auto child = walker.node(parent).first_child; child != AtomNode::npos; child = walker.node(child).next_sibling)
+                if (walker.node(child).data.isType(type))
+                    return child;
+            return AtomNode::npos;
+        }
+
+        inline uint32_t find_descendant(const BasicAtomWalker<byte_reader_t>& walker, uint32_t node, std::initializer_list<const char*> path)
+        {
+            for (auto type : path)
+            {
+                if (node == AtomNode::npos)
+                    break;
+                node = find_child(walker, node, type);
+            }
+            return node;
+        }
+    }
+
+    // serializes the sidecar for a mapped mp4 file with a moov
+    inline std::vector<char> build_index_cache(byte_span_t file, const index_cache_key_t& key)
+    {
+        byte_reader_t reader{file};
+        BasicAtomWalker<byte_reader_t> walker{reader};
+        while (walker.next())
+            ;
+
+        // the root node is the pseudo atom for the whole file
+        std::vector<cached_box_t> boxes;
+        boxes.reserve(walker.nodes.size() - 1);
+        for (size_t i = 1; i < walker.nodes.size(); ++i)
+        {
+            auto& node = walker.nodes[i];
+            boxes.push_back({
+                node.data.headerOffset(),
+                node.data.totalLength(),
+                node.data.type,
+                node.parent == 0 ? AtomNode::npos : node.parent - 1,
+                uint32_t(node.data.header_length),
+                node.depth - 1,
+            });
+        }
+
+        struct track_data_t
+        {
+            cached_track_t track;
+            std::vector<cached_sample_t> samples;
+            byte_span_t stsd;
+        };
+        std::vector<track_data_t> tracks;
+        auto moov = detail::find_child(walker, 0, "moov");
+        if (moov == AtomNode::npos)
+            throw std::runtime_error{"build_index_cache: no moov atom"};
+        for (auto trak = walker.node(moov).first_child; trak != AtomNode::npos; trak = walker.node(trak).next_sibling)
+        {
+            if (!walker.node(trak).data.isType("trak"))
+                continue;
+            auto tkhd = detail::find_child(walker, trak, "tkhd");
+            auto mdhd = detail::find_descendant(walker, trak, {"mdia", "mdhd"});
+            auto hdlr = detail::find_descendant(walker, trak, {"mdia", "hdlr"});
+            auto stbl = detail::find_descendant(walker, trak, {"mdia", "minf", "stbl"});
+            if (tkhd == AtomNode::npos || mdhd == AtomNode::npos || hdlr == AtomNode::npos || stbl == AtomNode::npos)
+                throw std::runtime_error{"build_index_cache: incomplete trak"};
+            auto table = [&](const char* type) {
+                auto node = detail::find_child(walker, stbl, type);
+                return node == AtomNode::npos ? std::optional<MP4Atom>{} : std::optional<MP4Atom>{walker.node(node).data};
+            };
+            stbl_t tables;
+            if (auto atom = table("stts"))
+                tables.stts = read_stts(reader, *atom);
+            if (auto atom = table("ctts"))
+                tables.ctts = read_ctts(reader, *atom);
+            if (auto atom = table("stss"))
+                tables.stss = read_stss(reader, *atom);
+            if (auto atom = table("stsc"))
+                tables.stsc = read_stsc(reader, *atom);
+            if (auto atom = table("stsz"))
+                tables.stsz = read_stsz(reader, *atom, tables.stts.sample_count());
+            if (auto atom = table("co64"))
+            {
+                tables.co64 = read_co64(reader, *atom);
+            }
+            else if (auto atom = table("stco"))
+            {
+                auto stco = read_stco(reader, *atom);
+                tables.co64.assign(stco.begin(), stco.end());
+            }
+            auto stsd = table("stsd");
+            if (!stsd)
+                throw std::runtime_error{"build_index_cache: trak without stsd"};
+
+            track_data_t data{};
+            data.track.track_id = read_tkhd(reader, walker.node(tkhd).data).track_id;
+            data.track.time_scale = read_mdhd(reader, walker.node(mdhd).data).time_scale;
+            data.track.handler_type = read_hdlr(reader, walker.node(hdlr).data).handler_type.value;
+            sample_index_t index{tables};
+            data.samples.resize(index.size());
+            for (uint32_t s = 0; s < index.size(); ++s)
+            {
+                auto info = index.at(s);
+                data.samples[s] = {info.offset, info.size, info.keyframe ? cached_sample_t::keyframe : 0, info.dts, info.pts};
+            }
+            data.track.sample_count = index.size();
+            data.stsd = file.subspan(stsd->headerOffset(), stsd->totalLength());
+            tracks.push_back(std::move(data));
+        }
+
+        std::vector<char> out;
+        index_cache_header_t header{};
+        std::memcpy(header.magic, index_cache_magic, sizeof(header.magic));
+        header.version = index_cache_version;
+        header.byte_order = index_cache_byte_order;
+        header.key = key;
+        header.box_count = uint32_t(boxes.size());
+        header.track_count = uint32_t(tracks.size());
+        header.boxes_offset = sizeof(index_cache_header_t);
+        header.tracks_offset = header.boxes_offset + boxes.size() * sizeof(cached_box_t);
+        // payload offsets of the tracks follow from the sizes
+        uint64_t offset = header.tracks_offset + tracks.size() * sizeof(cached_track_t);
+        for (auto& data : tracks)
+        {
+            offset = (offset + 7) & ~uint64_t(7);
+            data.track.samples_offset = offset;
+            offset += data.samples.size() * sizeof(cached_sample_t);
+            data.track.stsd_offset = offset;
+            data.track.stsd_size = data.stsd.size;
+            offset += data.stsd.size;
+        }
+        header.total_size = offset;
+        out.reserve(offset);
+        detail::put_struct(out, header);
+        for (auto& box : boxes)
+            detail::put_struct(out, box);
+        for (auto& data : tracks)
+            detail::put_struct(out, data.track);
+        for (auto& data : tracks)
+        {
+            detail::align_to_8(out);
+            auto samples = reinterpret_cast<const char*>(data.samples.data());
+            out.insert(out.end(), samples, samples + data.samples.size() * sizeof(cached_sample_t));
+            out.insert(out.end(), data.stsd.begin(), data.stsd.end());
+        }
+        BOOST_ASSERT(out.size() == header.total_size);
+        return out;
+    }
+
+    // writes the sidecar next to the final path and renames it into place,
+    // so readers never map a partially written file
+    inline void write_index_cache(const std::string& path, const std::vector<char>& bytes)
+    {
+        auto temporary = path + ".tmp" + std::to_string(::getpid());
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::system_error{errno, std::generic_category(), "write_index_cache: could not create '" + temporary + "'"};
+        size_t written = 0;
+        while (written < bytes.size())
+        {
+            auto n = ::write(fd, bytes.data() + written, bytes.size() - written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+            {
+                auto error = errno;
+                ::close(fd);
+                ::unlink(temporary.c_str());
+                throw std::system_error{error, std::generic_category(), "write_index_cache: write failed"};
+            }
+            written += size_t(n);
+        }
+        ::close(fd);
+        if (::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            auto error = errno;
+            ::unlink(temporary.c_str());
+            throw std::system_error{error, std::generic_category(), "write_index_cache: rename failed"};
+        }
+    }
+
+    // read-only view on a mapped sidecar. open() checks the format and the
+    // key and returns nothing for stale, foreign or damaged files, which the
+    // caller then rebuilds. all accessors are plain pointer arithmetic.
+    class index_cache_t
+    {
+    public:
+        static std::optional<index_cache_t> open(const std::string& path, const index_cache_key_t& key)
+        {
+            mapped_file_t file;
+            try
+            {
+                file = mapped_file_t{path};
+            }
+            catch (const std::runtime_error&)
+            {
+                return std::nullopt;
+            }
+            index_cache_t cache{std::move(file)};
+            if (!cache.valid() || cache.header().key != key)
+                return std::nullopt;
+            return cache;
+        }
+
+        const index_cache_header_t& header() const
+        {
+            return *reinterpret_cast<const index_cache_header_t*>(_file.data());
+        }
+
+        uint32_t box_count() const
+        {
+            return header().box_count;
+        }
+
+        const cached_box_t* boxes() const
+        {
+            return at<cached_box_t>(header().boxes_offset);
+        }
+
+        uint32_t track_count() const
+        {
+            return header().track_count;
+        }
+
+        const cached_track_t& track(uint32_t i) const
+        {
+            if (i >= track_count())
+                throw std::out_of_range{"index_cache_t: track index out of range"};
+            return at<cached_track_t>(header().tracks_offset)[i];
+        }
+
+        const cached_track_t* find_track(uint32_t track_id) const
+        {
+            for (uint32_t i = 0; i < track_count(); ++i)
+                if (track(i).track_id == track_id)
+                    return &track(i);
+            return nullptr;
+        }
+
+        const cached_sample_t* samples(const cached_track_t& track) const
+        {
+            return at<cached_sample_t>(track.samples_offset);
+        }
+
+        // the stsd box as found in the source, for read_stsd or decoders
+        byte_span_t stsd(const cached_track_t& track) const
+        {
+            return _file.span().subspan(track.stsd_offset, track.stsd_size);
+        }
+
+    private:
+        explicit index_cache_t(mapped_file_t file)
+        : _file{std::move(file)}
+        {
+        }
+
+        template<typename T>
+        const T* at(uint64_t offset) const
+        {
+            return reinterpret_cast<const T*>(_file.data() + offset);
+        }
+
+        // bounds of every array, so a damaged sidecar can't make us read
+        // outside the mapping
+        bool valid() const
+        {
+            auto span = _file.span();
+            if (span.size < sizeof(index_cache_header_t))
+                return false;
+            auto& h = header();
+            if (std::memcmp(h.magic, index_cache_magic, sizeof(h.magic)) != 0 ||
+                h.version != index_cache_version ||
+                h.byte_order != index_cache_byte_order ||
+                h.total_size != span.size)
+                return false;
+            if (h.boxes_offset % 8 || !span.contains(h.boxes_offset, uint64_t(h.box_count) * sizeof(cached_box_t)))
+                return false;
+            if (h.tracks_offset % 8 || !span.contains(h.tracks_offset, uint64_t(h.track_count) * sizeof(cached_track_t)))
+                return false;
+            for (uint32_t i = 0; i < h.track_count; ++i)
+            {
+                auto& t = at<cached_track_t>(h.tracks_offset)[i];
+                if (t.samples_offset % 8 || !span.contains(t.samples_offset, uint64_t(t.sample_count) * sizeof(cached_sample_t)))
+                    return false;
+                if (!span.contains(t.stsd_offset, t.stsd_size))
+                    return false;
+            }
+            return true;
+        }
+
+        mapped_file_t _file;
+    };
+
+    // maps the sidecar of a source file if it is current, otherwise builds
+    // and writes it first. the source has to be mapped anyway to check the
+    // moov hash.
+    inline index_cache_t open_index_cache(const std::string& source_path, const std::string& sidecar_path)
+    {
+        mapped_file_t source{source_path};
+        auto key = index_cache_key(source_path, source.span());
+        if (auto cache = index_cache_t::open(sidecar_path, key))
+            return std::move(*cache);
+        write_index_cache(sidecar_path, build_index_cache(source.span(), key));
+        if (auto cache = index_cache_t::open(sidecar_path, key))
+            return std::move(*cache);
+        throw std::runtime_error{"open_index_cache: could not read back '" + sidecar_path + "'"};
+    }
+}
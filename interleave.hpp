@@ -0,0 +1,132 @@
+#pragma once
+
+#include "MP4Atom.hpp"
+#include "sample_index.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// ---------------------- track interleaving --------------------------
+// with several tracks in one mdat, chunks of the tracks should alternate in
+// short time windows. otherwise players keep seeking between the audio and
+// the video region of the file.
+
+namespace my_remux::mp4
+{
+    struct interleave_config_t
+    {
+        // decode time covered by one chunk, in the movie time scale
+        int64_t window = 45000;
+    };
+
+    // one chunk of one track, in file order
+    struct chunk_ref_t
+    {
+        uint32_t track;
+        uint32_t chunk;
+        uint32_t first_sample;
+        uint32_t sample_count;
+        uint64_t size;
+    };
+
+    namespace detail
+    {
+        // a / a_scale < b / b_scale without overflow
+        inline bool time_less(int64_t a, uint32_t a_scale, int64_t b, uint32_t b_scale)
+        {
+            return __int128(a) * b_scale < __int128(b) * a_scale;
+        }
+    }
+
+    // rewrites stsc and co64 of every track so that each chunk holds the
+    // samples whose dts falls into one window. co64 is zeroed and has to be
+    // filled in by layout_chunks.
+    inline void chunk_by_time(moov_t& moov, const interleave_config_t& config = {})
+    {
+        if (config.window <= 0)
+            throw std::invalid_argument{"chunk_by_time: window must be positive"};
+        for (auto& trak : moov.traks)
+        {
+            auto& stbl = trak.mdia.minf.stbl;
+            if (stbl.stts.sample_count() != stbl.stsz.size())
+                throw std::runtime_error{"chunk_by_time: stts and stsz disagree on the sample count"};
+            auto track_scale = trak.mdia.mdhd.time_scale;
+            // window of a sample: dts * movie scale / (window * track scale)
+            auto divisor = __int128(config.window) * track_scale;
+            std::vector<uint32_t> chunk_sizes;
+            int64_t dts = 0;
+            int64_t current_window = -1;
+            for (auto& run : stbl.stts.runs())
+            {
+                for (uint32_t i = 0; i < run.count; ++i)
+                {
+                    auto window = int64_t(__int128(dts) * moov.mvhd.time_scale / divisor);
+                    if (chunk_sizes.empty() || window != current_window)
+                    {
+                        chunk_sizes.push_back(0);
+                        current_window = window;
+                    }
+                    ++chunk_sizes.back();
+                    dts += run.duration;
+                }
+            }
+            stbl.stsc.clear();
+            for (uint32_t chunk = 0; chunk < chunk_sizes.size(); ++chunk)
+                if (stbl.stsc.empty() || stbl.stsc.back().samples_per_chunk != chunk_sizes[chunk])
+                    stbl.stsc.push_back({chunk + 1, chunk_sizes[chunk], 1});
+            stbl.co64.assign(chunk_sizes.size(), 0);
+        }
+    }
+
+    // chunks of all tracks ordered by the dts of their first sample, ties
+    // broken by track order
+    inline std::vector<chunk_ref_t> interleaved_chunk_order(const moov_t& moov)
+    {
+        struct entry_t
+        {
+            chunk_ref_t chunk;
+            int64_t dts;
+            uint32_t time_scale;
+        };
+        std::vector<entry_t> entries;
+        for (uint32_t track = 0; track < moov.traks.size(); ++track)
+        {
+            auto& trak = moov.traks[track];
+            sample_index_t index{trak.mdia.minf.stbl, sample_index_layout_t::compact};
+            for (uint32_t chunk = 0; chunk < index.chunk_count(); ++chunk)
+            {
+                auto first = index.chunk_first_sample(chunk);
+                auto last = index.chunk_first_sample(chunk + 1);
+                if (first == last)
+                    continue;
+                uint64_t size = 0;
+                for (auto sample = first; sample < last; ++sample)
+                    size += index.size(sample);
+                entries.push_back({{track, chunk, first, last - first, size}, index.dts(first), trak.mdia.mdhd.time_scale});
+            }
+        }
+        std::stable_sort(entries.begin(), entries.end(), [](const entry_t& a, const entry_t& b) {
+            return detail::time_less(a.dts, a.time_scale, b.dts, b.time_scale);
+        });
+        std::vector<chunk_ref_t> order;
+        order.reserve(entries.size());
+        for (auto& entry : entries)
+            order.push_back(entry.chunk);
+        return order;
+    }
+
+    // places the chunks back to back in the given order, setting co64
+    // relative to the start of the mdat payload. returns the payload size.
+    inline uint64_t layout_chunks(moov_t& moov, const std::vector<chunk_ref_t>& order)
+    {
+        uint64_t offset = 0;
+        for (auto& chunk : order)
+        {
+            moov.traks.at(chunk.track).mdia.minf.stbl.co64.at(chunk.chunk) = offset;
+            offset += chunk.size;
+        }
+        return offset;
+    }
+}
@@ -49,6 +49,7 @@ namespace game_on
         case nalu_kind_t::h265:
             return t >= 16 && t <= 21;
         }
+        return false;
     }
 
     inline const bool nalu_is_parameter_set(nalu_kind_t kind, uint8_t t)
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "MP4Atom.hpp"
+#include "sample_index.hpp"
+
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+// ---------------------- nalus in memory --------------------------
+
+namespace my_remux::mp4
+{
+    // forward iterator over the length prefixed nalus of a contiguous buffer,
+    // e.g. one sample or a whole mdat. yields NALU views whose offsets are
+    // relative to base_offset, so they match file offsets for mapped files.
+    class nalu_iterator_t
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = NALU;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const NALU*;
+        using reference = NALU;
+
+        nalu_iterator_t() = default;
+
+        nalu_iterator_t(byte_span_t data, size_t position, size_t base_offset, size_t length_size, game_on::nalu_kind_t kind)
+        : _data{data}
+        , _position{position}
+        , _base_offset{base_offset}
+        , _length_size{length_size}
+        , _kind{kind}
+        {
+            if (length_size != 1 && length_size != 2 && length_size != 4)
+                throw std::invalid_argument{"nalu_iterator_t: nalu length field must have 1, 2 or 4 bytes"};
+            load();
+        }
+
+        NALU operator*() const
+        {
+            Box box{_base_offset + _position + _length_size, _length, _length_size};
+            return NALU(box, uint8_t(_data.data[_position + _length_size]), _kind);
+        }
+
+        // pointer to the nalu header byte
+        const char* data() const
+        {
+            return _data.data + _position + _length_size;
+        }
+
+        size_t size() const
+        {
+            return _length;
+        }
+
+        uint8_t type() const
+        {
+            return game_on::nalu_type(_kind, data());
+        }
+
+        nalu_iterator_t& operator++()
+        {
+            _position += _length_size + _length;
+            load();
+            return *this;
+        }
+
+        nalu_iterator_t operator++(int)
+        {
+            auto result = *this;
+            ++*this;
+            return result;
+        }
+
+        bool operator==(const nalu_iterator_t& other) const
+        {
+            return _position == other._position;
+        }
+
+        bool operator!=(const nalu_iterator_t& other) const
+        {
+            return _position != other._position;
+        }
+
+    private:
+        void load()
+        {
+            if (_position >= _data.size)
+            {
+                _position = _data.size;
+                _length = 0;
+                return;
+            }
+            if (_data.size - _position < _length_size)
+                throw std::runtime_error{"nalu_iterator_t: truncated nalu length field"};
+            auto p = reinterpret_cast<const unsigned char*>(_data.data + _position);
+            size_t length = 0;
+            for (size_t i = 0; i < _length_size; ++i)
+                length = (length << 8) | p[i];
+            if (length == 0 || length > _data.size - _position - _length_size)
+                throw std::runtime_error{"nalu_iterator_t: nalu exceeds buffer"};
+            _length = length;
+        }
+
+        byte_span_t _data;
+        size_t _position = 0;
+        size_t _base_offset = 0;
+        size_t _length_size = 4;
+        game_on::nalu_kind_t _kind = game_on::nalu_kind_t::h264;
+        size_t _length = 0;
+    };
+
+    class nalu_range_t
+    {
+    public:
+        nalu_range_t(byte_span_t data, size_t base_offset, size_t length_size, game_on::nalu_kind_t kind)
+        : _data{data}
+        , _base_offset{base_offset}
+        , _length_size{length_size}
+        , _kind{kind}
+        {
+        }
+
+        nalu_iterator_t begin() const
+        {
+            return nalu_iterator_t{_data, 0, _base_offset, _length_size, _kind};
+        }
+
+        nalu_iterator_t end() const
+        {
+            return nalu_iterator_t{_data, _data.size, _base_offset, _length_size, _kind};
+        }
+
+    private:
+        byte_span_t _data;
+        size_t _base_offset;
+        size_t _length_size;
+        game_on::nalu_kind_t _kind;
+    };
+
+    // what a sample contains, one byte per sample
+    struct nalu_summary_t
+    {
+        static constexpr uint8_t vcl = 0x1;
+        static constexpr uint8_t keyframe = 0x2;
+        static constexpr uint8_t parameter_set = 0x4;
+
+        uint8_t flags = 0;
+
+        bool has_vcl() const
+        {
+            return flags & vcl;
+        }
+        bool is_keyframe() const
+        {
+            return flags & keyframe;
+        }
+        bool has_parameter_set() const
+        {
+            return flags & parameter_set;
+        }
+    };
+
+    inline nalu_summary_t summarize_nalus(byte_span_t sample, size_t length_size, game_on::nalu_kind_t kind)
+    {
+        nalu_summary_t summary;
+        nalu_range_t nalus{sample, 0, length_size, kind};
+        for (auto it = nalus.begin(); it != nalus.end(); ++it)
+        {
+            auto type = it.type();
+            if (game_on::nalu_is_vcl(kind, type))
+                summary.flags |= nalu_summary_t::vcl;
+            if (game_on::nalu_is_keyframe(kind, type))
+                summary.flags |= nalu_summary_t::keyframe;
+            if (game_on::nalu_is_parameter_set(kind, type))
+                summary.flags |= nalu_summary_t::parameter_set;
+        }
+        return summary;
+    }
+
+    // classifies every sample of a track straight from the mapped file
+    inline std::vector<nalu_summary_t> summarize_samples(
+        byte_span_t file,
+        const sample_index_t& index,
+        size_t length_size,
+        game_on::nalu_kind_t kind
+    )
+    {
+        std::vector<nalu_summary_t> summaries(index.size());
+        for (uint32_t sample = 0; sample < index.size(); ++sample)
+            summaries[sample] = summarize_nalus(file.subspan(index.offset(sample), index.size(sample)), length_size, kind);
+        return summaries;
+    }
+}
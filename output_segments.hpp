@@ -0,0 +1,265 @@
+#pragma once
+
+#include "byte_source.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <system_error>
+#include <variant>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+// ---------------------- scatter gather output --------------------------
+// output as a list of segments: small serialized boxes kept in memory and
+// references to byte ranges of source files, so sample payloads never have
+// to pass through user space when remuxing.
+
+namespace my_remux::mp4
+{
+    struct file_range_t
+    {
+        int fd;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    // owned bytes, borrowed memory or a range of a source file
+    using output_segment_t = std::variant<std::vector<char>, byte_span_t, file_range_t>;
+
+    inline uint64_t segment_size(const output_segment_t& segment)
+    {
+        struct
+        {
+            uint64_t operator()(const std::vector<char>& bytes) const {return bytes.size();}
+            uint64_t operator()(const byte_span_t& span) const {return span.size;}
+            uint64_t operator()(const file_range_t& range) const {return range.length;}
+        } size;
+        return std::visit(size, segment);
+    }
+
+    class segment_list_t
+    {
+    public:
+        void append(std::vector<char> bytes)
+        {
+            if (bytes.empty())
+                return;
+            _size += bytes.size();
+            if (!_segments.empty())
+            {
+                if (auto last = std::get_if<std::vector<char>>(&_segments.back()))
+                {
+                    last->insert(last->end(), bytes.begin(), bytes.end());
+                    return;
+                }
+            }
+            _segments.push_back(std::move(bytes));
+        }
+
+        // the memory has to outlive the list
+        void append(byte_span_t span)
+        {
+            if (span.size == 0)
+                return;
+            _size += span.size;
+            _segments.push_back(span);
+        }
+
+        // adjacent ranges of the same file are merged, so appending samples
+        // one by one still yields one segment per contiguous run
+        void append(file_range_t range)
+        {
+            if (range.length == 0)
+                return;
+            _size += range.length;
+            if (!_segments.empty())
+            {
+                auto last = std::get_if<file_range_t>(&_segments.back());
+                if (last && last->fd == range.fd && last->offset + last->length == range.offset)
+                {
+                    last->length += range.length;
+                    return;
+                }
+            }
+            _segments.push_back(range);
+        }
+
+        void append(const segment_list_t& other)
+        {
+            for (auto& segment : other._segments)
+                std::visit([this](auto& s) {append(s);}, segment);
+        }
+
+        const std::vector<output_segment_t>& segments() const
+        {
+            return _segments;
+        }
+
+        // total number of output bytes
+        uint64_t size() const
+        {
+            return _size;
+        }
+
+        void clear()
+        {
+            _segments.clear();
+            _size = 0;
+        }
+
+    private:
+        std::vector<output_segment_t> _segments;
+        uint64_t _size = 0;
+    };
+
+    // writes segment lists to a file descriptor (file, pipe or socket).
+    // memory segments are batched into writev calls, file ranges are copied
+    // in the kernel with copy_file_range or sendfile where possible.
+    class fd_sink_t
+    {
+    public:
+        explicit fd_sink_t(int fd)
+        : _fd{fd}
+        {
+        }
+
+        void write(const segment_list_t& list)
+        {
+            std::vector<iovec> iov;
+            for (auto& segment : list.segments())
+            {
+                if (auto range = std::get_if<file_range_t>(&segment))
+                {
+                    flush(iov);
+                    copy_range(*range);
+                }
+                else if (auto bytes = std::get_if<std::vector<char>>(&segment))
+                {
+                    iov.push_back({const_cast<char*>(bytes->data()), bytes->size()});
+                }
+                else
+                {
+                    auto& span = std::get<byte_span_t>(segment);
+                    iov.push_back({const_cast<char*>(span.data), span.size});
+                }
+                if (iov.size() >= IOV_MAX)
+                    flush(iov);
+            }
+            flush(iov);
+        }
+
+        uint64_t written() const
+        {
+            return _written;
+        }
+
+    private:
+        void flush(std::vector<iovec>& iov)
+        {
+            size_t first = 0;
+            while (first < iov.size())
+            {
+                auto n = ::writev(_fd, iov.data() + first, int(iov.size() - first));
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    throw std::system_error{errno, std::generic_category(), "fd_sink_t: writev failed"};
+                }
+                _written += n;
+                // skip what was written, partial writes leave a partial iovec
+                for (size_t left = size_t(n); left > 0;)
+                {
+                    auto step = std::min(left, iov[first].iov_len);
+                    iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + step;
+                    iov[first].iov_len -= step;
+                    left -= step;
+                    if (iov[first].iov_len == 0)
+                        ++first;
+                }
+                while (first < iov.size() && iov[first].iov_len == 0)
+                    ++first;
+            }
+            iov.clear();
+        }
+
+        void copy_range(file_range_t range)
+        {
+            auto offset = off_t(range.offset);
+            auto left = range.length;
+#if defined(__linux__)
+            while (left > 0 && _use_copy_file_range)
+            {
+                auto n = ::copy_file_range(range.fd, &offset, _fd, nullptr, left, 0);
+                if (n > 0)
+                {
+                    left -= n;
+                    _written += n;
+                }
+                else if (n == 0)
+                {
+                    throw std::runtime_error{"fd_sink_t: source file ended before the referenced range"};
+                }
+                else if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)
+                {
+                    _use_copy_file_range = false;
+                }
+                else if (errno != EINTR)
+                {
+                    throw std::system_error{errno, std::generic_category(), "fd_sink_t: copy_file_range failed"};
+                }
+            }
+            while (left > 0 && _use_sendfile)
+            {
+                auto n = ::sendfile(_fd, range.fd, &offset, left);
+                if (n > 0)
+                {
+                    left -= n;
+                    _written += n;
+                }
+                else if (n == 0)
+                {
+                    throw std::runtime_error{"fd_sink_t: source file ended before the referenced range"};
+                }
+                else if (errno == EINVAL || errno == ENOSYS)
+                {
+                    _use_sendfile = false;
+                }
+                else if (errno != EINTR && errno != EAGAIN)
+                {
+                    throw std::system_error{errno, std::generic_category(), "fd_sink_t: sendfile failed"};
+                }
+            }
+#endif
+            // plain copy through a bounce buffer
+            std::vector<char> buffer;
+            while (left > 0)
+            {
+                buffer.resize(std::min<uint64_t>(left, 1 << 20));
+                auto n = ::pread(range.fd, buffer.data(), buffer.size(), offset);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    throw std::system_error{errno, std::generic_category(), "fd_sink_t: pread failed"};
+                if (n == 0)
+                    throw std::runtime_error{"fd_sink_t: source file ended before the referenced range"};
+                std::vector<iovec> iov{{buffer.data(), size_t(n)}};
+                flush(iov);
+                offset += n;
+                left -= n;
+            }
+        }
+
+        int _fd;
+        uint64_t _written = 0;
+        bool _use_copy_file_range = true;
+        bool _use_sendfile = true;
+    };
+}
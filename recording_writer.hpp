@@ -0,0 +1,654 @@
+#pragma once
+
+#include "MP4Atom.hpp"
+#include "access_unit.hpp"
+#include "byte_source.hpp"
+#include "fast_start.hpp"
+#include "segmenter.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// ---------------------- crash safe recording --------------------------
+// a recording that writes its moov only when it ends is lost with the
+// process. this writer appends samples to an mdat that runs to the end of
+// the file and keeps a moov snapshot in one of two slots reserved in front
+// of it. a checkpoint fills the inactive slot, disguised as a free box, and
+// only then renames it to moov and the previous snapshot to free, so the
+// file always holds a complete moov. what was written after the last
+// checkpoint is found again by recover_recording, which scans the nalus.
+//
+// layout: ftyp, slot 0, slot 1, free (8 bytes), mdat (size 0 until finish)
+
+namespace my_remux::mp4
+{
+    namespace detail
+    {
+        // media, track and movie durations of a single track recording
+        inline void set_recording_durations(moov_t& moov)
+        {
+            auto& trak = moov.traks.front();
+            auto total = trak.mdia.minf.stbl.stts.total();
+            trak.mdia.mdhd.duration = uint64_t(total);
+            trak.tkhd.duration = uint64_t(rescale(total, trak.mdia.mdhd.time_scale, moov.mvhd.time_scale, rounding_t::up));
+            moov.mvhd.duration = trak.tkhd.duration;
+        }
+    }
+
+    struct recording_config_t
+    {
+        // checkpoint once this much media time, in the track time scale, or
+        // this much payload was written since the last checkpoint
+        int64_t checkpoint_duration = 5 * 90000;
+        uint64_t checkpoint_bytes = 16 << 20;
+        // size of each snapshot slot, which bounds what a checkpoint writes.
+        // about 4 bytes per sample; a moov outgrowing it ends checkpointing,
+        // the rest of the recording is then left to recovery.
+        uint32_t snapshot_size = 1 << 20;
+        // fdatasync at checkpoints. without it checkpoints survive a crash
+        // of the process, which leaves the page cache intact, but not one of
+        // the host; with many streams per host that is the cheaper choice.
+        bool sync = true;
+        // duration of the last sample, which has no successor yet
+        uint32_t default_sample_duration = 3000;
+    };
+
+    class recording_writer_t
+    {
+    public:
+        // moov describes the single track, with its sample entry and time
+        // scales; its sample tables have to be empty
+        recording_writer_t(const std::string& path, moov_t moov, const recording_config_t& config = {}, const ftyp_t& ftyp = {})
+        : _moov{std::move(moov)}
+        , _config{config}
+        {
+            if (_moov.traks.size() != 1)
+                throw std::invalid_argument{"recording_writer_t: a recording has exactly one track"};
+            if (_config.snapshot_size < 8)
+                throw std::invalid_argument{"recording_writer_t: snapshot slots need room for a box header"};
+            auto& stbl = stbl_of(_moov);
+            if (!stbl.stsz.empty() || !stbl.co64.empty())
+                throw std::invalid_argument{"recording_writer_t: the track must not have samples yet"};
+            _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (_fd < 0)
+                throw std::system_error{errno, std::generic_category(), "recording_writer_t: could not create '" + path + "'"};
+
+            std::vector<char> head;
+            write_ftyp(head, ftyp);
+            for (auto& slot : _slots)
+            {
+                slot = head.size();
+                put_free(head, _config.snapshot_size);
+            }
+            _mdat_offset = head.size() + 8;
+            put_free(head, 8); // becomes part of a 64 bit mdat header if needed
+            put_number(uint32_t(0), head); // the mdat extends to the end of the file
+            put_fourcc("mdat", head);
+            _end = head.size();
+            _checkpoint_end = _end;
+            write_bytes(0, head.data(), head.size());
+        }
+
+        recording_writer_t(const recording_writer_t&) = delete;
+        recording_writer_t& operator=(const recording_writer_t&) = delete;
+
+        // closes the file as it is: without finish() it is left like after
+        // a crash, with the last checkpoint in effect
+        ~recording_writer_t()
+        {
+            ::close(_fd);
+        }
+
+        // appends a sample in decoding order. the payload goes to the file
+        // right away; a checkpoint follows if one is due.
+        void write(const fragment_sample_t& sample)
+        {
+            if (_finished)
+                throw std::logic_error{"recording_writer_t: recording already finished"};
+            auto& stbl = stbl_of(_moov);
+            if (!stbl.stsz.empty())
+            {
+                if (sample.dts < _last_dts || sample.dts - _last_dts > INT32_MAX)
+                    throw std::runtime_error{"recording_writer_t: decode times must increase by at most 2^31"};
+                stbl.stts.push_run({1, int32_t(sample.dts - _last_dts)});
+            }
+            else
+            {
+                _checkpoint_dts = sample.dts;
+            }
+            write_bytes(_end, sample.data, sample.size);
+
+            if (!_chunk_open)
+            {
+                stbl.co64.push_back(_end);
+                _chunk_samples.push_back(0);
+                _chunk_open = true;
+            }
+            ++_chunk_samples.back();
+            stbl.stsz.push_back(uint32_t(sample.size));
+            if (sample.keyframe)
+                stbl.stss.keyframe_indices.push_back(uint32_t(stbl.stsz.size()));
+            stbl.ctts.push_run({1, int32_t(sample.pts - sample.dts)});
+            _last_dts = sample.dts;
+            _end += sample.size;
+
+            if (_snapshot_full)
+                return;
+            if (sample.dts - _checkpoint_dts >= _config.checkpoint_duration || _end - _checkpoint_end >= _config.checkpoint_bytes)
+                checkpoint();
+        }
+
+        // writes a snapshot of everything written so far. false if the moov
+        // no longer fits a slot; checkpointing has ended then.
+        bool checkpoint()
+        {
+            if (_snapshot_full || _finished)
+                return false;
+            if (!serialize_snapshot())
+            {
+                _snapshot_full = true;
+                return false;
+            }
+            auto slot = _active ? 1 - *_active : 0;
+            write_bytes(_slots[slot], _snapshot.data(), _snapshot.size());
+            sync();
+            // a crash between the renames leaves two moovs, each of them
+            // complete, or the old one alone
+            write_bytes(_slots[slot] + 4, "moov", 4);
+            sync();
+            if (_active)
+                write_bytes(_slots[*_active] + 4, "free", 4);
+            _active = slot;
+            _chunk_open = false;
+            _checkpoint_dts = _last_dts;
+            _checkpoint_end = _end;
+            ++_checkpoints;
+            return true;
+        }
+
+        // gives the mdat its size and writes the final moov: into a slot if
+        // it fits, which makes the file fast start, otherwise after the mdat
+        void finish()
+        {
+            if (_finished)
+                return;
+            auto payload = _end - _mdat_offset - 8;
+            if (payload + 8 <= UINT32_MAX)
+            {
+                write_number(_mdat_offset, uint32_t(payload + 8));
+            }
+            else
+            {
+                // the free box in front of the mdat turns into its large size
+                char header[16];
+                copy_number(uint32_t(1), header);
+                std::copy_n("mdat", 4, header + 4);
+                copy_number(uint64_t(payload + 16), header + 8);
+                write_bytes(_mdat_offset - 8, header, sizeof(header));
+            }
+            _snapshot_full = false;
+            if (!checkpoint())
+            {
+                std::vector<char> moov;
+                write_moov(moov, snapshot_moov());
+                write_bytes(_end, moov.data(), moov.size());
+                sync();
+                if (_active)
+                    write_bytes(_slots[*_active] + 4, "free", 4);
+                _active.reset();
+            }
+            sync();
+            _finished = true;
+        }
+
+        uint32_t sample_count() const
+        {
+            return uint32_t(stbl_of(_moov).stsz.size());
+        }
+
+        uint64_t checkpoint_count() const
+        {
+            return _checkpoints;
+        }
+
+        // whether the moov outgrew the slots
+        bool snapshot_full() const
+        {
+            return _snapshot_full;
+        }
+
+        // file offset past the last sample
+        uint64_t end() const
+        {
+            return _end;
+        }
+
+    private:
+        static stbl_t& stbl_of(moov_t& moov)
+        {
+            return moov.traks.front().mdia.minf.stbl;
+        }
+
+        static const stbl_t& stbl_of(const moov_t& moov)
+        {
+            return moov.traks.front().mdia.minf.stbl;
+        }
+
+        // the moov as it would be if the recording ended now: the last
+        // sample gets the default duration, the chunks go to stsc
+        moov_t snapshot_moov() const
+        {
+            moov_t moov;
+            moov.mvhd = _moov.mvhd;
+            auto& trak = moov.traks.emplace_back();
+            auto& source = _moov.traks.front();
+            trak.tkhd = source.tkhd;
+            trak.edts = source.edts;
+            trak.mdia.mdhd = source.mdia.mdhd;
+            trak.mdia.hdlr = source.mdia.hdlr;
+            trak.mdia.minf.media_header = source.mdia.minf.media_header;
+            trak.mdia.minf.dinf = source.mdia.minf.dinf;
+            auto& from = stbl_of(_moov);
+            auto& stbl = trak.mdia.minf.stbl;
+            stbl.stsd = from.stsd;
+            stbl.stts = from.stts;
+            if (!from.stsz.empty())
+                stbl.stts.push_run({1, int32_t(_config.default_sample_duration)});
+            stbl.stss = from.stss;
+            if (std::any_of(from.ctts.runs().begin(), from.ctts.runs().end(), [](const tts_t& run) { return run.duration != 0; }))
+                stbl.ctts = from.ctts;
+            for (uint32_t chunk = 0; chunk < _chunk_samples.size(); ++chunk)
+                if (stbl.stsc.empty() || stbl.stsc.back().samples_per_chunk != _chunk_samples[chunk])
+                    stbl.stsc.push_back({chunk + 1, _chunk_samples[chunk], 1});
+            stbl.stsz = from.stsz;
+            stbl.co64 = from.co64;
+            detail::set_recording_durations(moov);
+            return moov;
+        }
+
+        // the snapshot as a slot: the moov disguised as free, followed by a
+        // free box taking the rest of the slot
+        bool serialize_snapshot()
+        {
+            auto moov = snapshot_moov();
+            auto size = size_of_moov(moov);
+            auto room = _config.snapshot_size;
+            if (size != room && size + 8 > room)
+                return false;
+            _snapshot.clear();
+            write_moov(_snapshot, moov);
+            std::copy_n("free", 4, _snapshot.data() + 4);
+            if (size != room)
+                put_free(_snapshot, room - uint32_t(size));
+            return true;
+        }
+
+        static void put_free(std::vector<char>& out, uint32_t size)
+        {
+            put_number(size, out);
+            put_fourcc("free", out);
+            out.resize(out.size() + size - 8);
+        }
+
+        void sync()
+        {
+            if (_config.sync && ::fdatasync(_fd) != 0)
+                throw std::system_error{errno, std::generic_category(), "recording_writer_t: fdatasync failed"};
+        }
+
+        template<typename T>
+        void write_number(uint64_t offset, T value)
+        {
+            char bytes[sizeof(T)];
+            copy_number(value, bytes);
+            write_bytes(offset, bytes, sizeof(T));
+        }
+
+        void write_bytes(uint64_t offset, const char* data, size_t size)
+        {
+            size_t written = 0;
+            while (written < size)
+            {
+                auto n = ::pwrite(_fd, data + written, size - written, off_t(offset + written));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                    throw std::system_error{errno, std::generic_category(), "recording_writer_t: pwrite failed"};
+                written += size_t(n);
+            }
+        }
+
+        moov_t _moov; // sample tables of everything written, stts without the last sample
+        recording_config_t _config;
+        int _fd = -1;
+        uint64_t _slots[2] = {};
+        std::optional<int> _active; // slot holding the moov
+        uint64_t _mdat_offset = 0;
+        uint64_t _end = 0;
+        int64_t _last_dts = 0;
+        std::vector<uint32_t> _chunk_samples; // one chunk per checkpoint interval
+        bool _chunk_open = false;
+        int64_t _checkpoint_dts = 0;
+        uint64_t _checkpoint_end = 0;
+        uint64_t _checkpoints = 0;
+        bool _snapshot_full = false;
+        bool _finished = false;
+        std::vector<char> _snapshot; // reused between checkpoints
+    };
+
+    struct recovery_config_t
+    {
+        // duration of every sample found by scanning; decode times are not
+        // in the bitstream
+        uint32_t sample_duration = 3000;
+    };
+
+    struct recovered_recording_t
+    {
+        moov_t moov;
+        uint64_t mdat_offset = 0; // of the mdat header
+        uint32_t mdat_header_size = 8;
+        bool mdat_widenable = false; // an 8 byte free box precedes the mdat
+        uint64_t end = 0; // past the last recovered sample
+        uint32_t snapshot_samples = 0; // taken from the moov snapshot
+        uint32_t scanned_samples = 0; // found by scanning the mdat
+        std::vector<uint64_t> moov_offsets; // every top level moov
+    };
+
+    namespace detail
+    {
+        // top level boxes of a file that may end anywhere. a box running past
+        // the end is cut at it, garbage ends the walk.
+        inline std::vector<MP4Atom> salvage_top_level_atoms(byte_span_t file)
+        {
+            std::vector<MP4Atom> atoms;
+            size_t offset = 0;
+            while (file.size - offset >= 8)
+            {
+                uint64_t size = read_to_host<uint32_t>(file.data + offset);
+                size_t header_length = 8;
+                if (size == 1)
+                {
+                    if (file.size - offset < 16)
+                        break;
+                    size = read_to_host<uint64_t>(file.data + offset + 8);
+                    header_length = 16;
+                }
+                // size 0 and boxes cut off by the end of the file reach to it
+                if (size == 0 || size > file.size - offset)
+                    size = file.size - offset;
+                if (size < header_length)
+                    break;
+                uint32_t type;
+                std::memcpy(&type, file.data + offset + 4, sizeof(type));
+                atoms.emplace_back(offset + header_length, size_t(size) - header_length, header_length, type);
+                offset += size_t(size);
+            }
+            return atoms;
+        }
+
+        // nalu format of a video sample entry
+        inline std::optional<std::pair<game_on::nalu_kind_t, size_t>> nalu_format(const stsd_t& stsd)
+        {
+            if (auto avc1 = std::get_if<avc1_t>(&stsd.entry))
+                return std::pair{game_on::nalu_kind_t::h264, size_t(avc1->avcC.naluLengthFieldSize)};
+            if (auto hvc1 = std::get_if<hvc1_t>(&stsd.entry))
+                return std::pair{game_on::nalu_kind_t::h265, size_t(hvc1->hvcC.naluLengthFieldSize)};
+            if (auto hev1 = std::get_if<hev1_t>(&stsd.entry))
+                return std::pair{game_on::nalu_kind_t::h265, size_t(hev1->hvcC.naluLengthFieldSize)};
+            return std::nullopt;
+        }
+
+        // groups the length prefixed nalus at the start of data into access
+        // units. the scan ends at zeros, at a nalu header with the forbidden
+        // bit set and at a nalu running past the data, as left by a torn
+        // write. the access unit in progress is handed out only if what
+        // follows shows it complete, else it may lack slices. the end of
+        // data counts as such only if data_complete, i.e. the mdat had its
+        // size written. returns the bytes consumed.
+        template<typename F>
+        inline size_t scan_access_units(byte_span_t data, size_t length_size, game_on::nalu_kind_t kind, bool data_complete, F&& on_access_unit)
+        {
+            game_on::access_unit_assembler_t assembler{kind};
+            size_t position = 0;
+            while (data.size - position > length_size)
+            {
+                auto p = reinterpret_cast<const unsigned char*>(data.data + position);
+                size_t length = 0;
+                for (size_t i = 0; i < length_size; ++i)
+                    length = (length << 8) | p[i];
+                if (length == 0 || (p[length_size] & 0x80))
+                    break;
+                game_on::nalu_span_t nalu{data.data + position + length_size, std::min(length, data.size - position - length_size)};
+                if (nalu.size < length)
+                {
+                    // the start of a torn nalu still tells whether it began
+                    // a new access unit
+                    if (game_on::nalu_starts_access_unit(kind, nalu, true))
+                        assembler.flush(on_access_unit);
+                    return position;
+                }
+                assembler.push(nalu, on_access_unit);
+                position += length_size + length;
+            }
+            if (position == data.size && data_complete)
+                assembler.flush(on_access_unit);
+            return position;
+        }
+    }
+
+    // rebuilds the sample table of a recording that was cut short: the most
+    // complete moov snapshot in the file, extended by the access units found
+    // by scanning the mdat after its last sample. without a usable snapshot,
+    // e.g. for a recording that meant to write its moov at the end, the
+    // scan starts at the mdat and track describes the stream: one trak with
+    // sample entry and time scales. only single track h.264 and h.265
+    // recordings are scanned. scanned samples get the configured duration,
+    // and no composition offsets, so b-frames present in decoding order.
+    inline recovered_recording_t recover_recording(byte_span_t file, const std::optional<moov_t>& track = std::nullopt, const recovery_config_t& config = {})
+    {
+        recovered_recording_t result;
+        std::optional<MP4Atom> mdat;
+        std::optional<MP4Atom> previous;
+        byte_reader_t reader{file};
+        int64_t best = -1;
+        for (auto& atom : detail::salvage_top_level_atoms(file))
+        {
+            if (atom.isType("mdat") && !mdat)
+            {
+                mdat = atom;
+                result.mdat_widenable = previous && previous->isType("free") && previous->totalLength() == 8;
+            }
+            else if (atom.isType("moov"))
+            {
+                result.moov_offsets.push_back(atom.headerOffset());
+                try
+                {
+                    auto moov = read_moov(reader, atom);
+                    if (moov.traks.size() != 1)
+                        continue;
+                    auto& stbl = moov.traks.front().mdia.minf.stbl;
+                    // a snapshot whose samples aren't all there was never synced
+                    if (int64_t(stbl.stsz.size()) > best && mdat_payload_size(stbl) <= file.size)
+                    {
+                        best = int64_t(stbl.stsz.size());
+                        result.moov = std::move(moov);
+                    }
+                }
+                catch (const std::exception&)
+                {
+                    // a torn or foreign moov; another one may do
+                }
+            }
+            previous = atom;
+        }
+        if (!mdat)
+            throw std::runtime_error{"recover_recording: no mdat"};
+        if (best < 0)
+        {
+            if (!track || track->traks.size() != 1)
+                throw std::invalid_argument{"recover_recording: no moov snapshot, the track has to be given"};
+            result.moov = *track;
+            auto& stbl = result.moov.traks.front().mdia.minf.stbl;
+            stbl.stts = {};
+            stbl.ctts = {};
+            stbl.stss = {};
+            stbl.stsc.clear();
+            stbl.stsz.clear();
+            stbl.co64.clear();
+        }
+        result.mdat_offset = mdat->headerOffset();
+        result.mdat_header_size = uint32_t(mdat->header_length);
+        auto& stbl = result.moov.traks.front().mdia.minf.stbl;
+        result.snapshot_samples = uint32_t(stbl.stsz.size());
+        result.end = std::max<uint64_t>(mdat_payload_size(stbl), mdat->content_offset);
+
+        auto format = detail::nalu_format(stbl.stsd);
+        if (format && result.end < mdat->endOffset())
+        {
+            struct found_t
+            {
+                uint64_t offset;
+                uint32_t size;
+                bool keyframe;
+            };
+            std::vector<found_t> found;
+            auto [kind, length_size] = *format;
+            auto data = file.subspan(result.end, mdat->endOffset() - result.end);
+            // a size 0 or torn mdat may stop between two slices of a picture
+            uint64_t declared = read_to_host<uint32_t>(file.data + mdat->headerOffset());
+            if (declared == 1)
+                declared = read_to_host<uint64_t>(file.data + mdat->headerOffset() + 8);
+            bool sized = declared == mdat->totalLength();
+            detail::scan_access_units(data, length_size, kind, sized, [&](const game_on::access_unit_t& unit) {
+                if (!unit.has_vcl)
+                    return;
+                auto begin = unit.nalus.front().data - length_size;
+                auto end = unit.nalus.back().data + unit.nalus.back().size;
+                found.push_back({result.end + uint64_t(begin - data.data), uint32_t(end - begin), unit.keyframe});
+            });
+
+            if (!found.empty())
+            {
+                // without stss every sample was a keyframe, which has to be
+                // spelled out once some are not
+                if (stbl.stss.keyframe_indices.empty())
+                    for (uint32_t sample = 1; sample <= stbl.stsz.size(); ++sample)
+                        stbl.stss.keyframe_indices.push_back(sample);
+                uint64_t chunk_end = 0;
+                uint32_t chunk_samples = 0;
+                auto close_chunk = [&] {
+                    if (chunk_samples == 0)
+                        return;
+                    auto chunk = uint32_t(stbl.co64.size());
+                    if (stbl.stsc.empty() || stbl.stsc.back().samples_per_chunk != chunk_samples || stbl.stsc.back().sample_description_index != 1)
+                        stbl.stsc.push_back({chunk, chunk_samples, 1});
+                    chunk_samples = 0;
+                };
+                for (auto& sample : found)
+                {
+                    if (chunk_samples == 0 || sample.offset != chunk_end)
+                    {
+                        close_chunk();
+                        stbl.co64.push_back(sample.offset);
+                    }
+                    ++chunk_samples;
+                    chunk_end = sample.offset + sample.size;
+                    stbl.stsz.push_back(sample.size);
+                    if (sample.keyframe)
+                        stbl.stss.keyframe_indices.push_back(uint32_t(stbl.stsz.size()));
+                }
+                close_chunk();
+                stbl.stts.push_run({uint32_t(found.size()), int32_t(config.sample_duration)});
+                if (!stbl.ctts.empty())
+                    stbl.ctts.push_run({uint32_t(found.size()), 0});
+                result.scanned_samples = uint32_t(found.size());
+                result.end = chunk_end;
+            }
+        }
+        detail::set_recording_durations(result.moov);
+        return result;
+    }
+
+    // makes a recording that was cut short playable: cuts off what could not
+    // be recovered, gives the mdat its size, appends the recovered moov and
+    // turns the snapshots into free boxes
+    inline recovered_recording_t repair_recording(const std::string& path, const std::optional<moov_t>& track = std::nullopt, const recovery_config_t& config = {})
+    {
+        recovered_recording_t recovered;
+        {
+            mapped_file_t file{path};
+            recovered = recover_recording(file.span(), track, config);
+        }
+        int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::system_error{errno, std::generic_category(), "repair_recording: could not open '" + path + "'"};
+        auto fail = [&](const char* what) {
+            auto error = errno;
+            ::close(fd);
+            throw std::system_error{error, std::generic_category(), std::string("repair_recording: ") + what};
+        };
+        auto write_at = [&](uint64_t offset, const std::vector<char>& bytes) {
+            for (size_t written = 0; written < bytes.size();)
+            {
+                auto n = ::pwrite(fd, bytes.data() + written, bytes.size() - written, off_t(offset + written));
+                if (n < 0 && errno != EINTR)
+                    fail("pwrite failed");
+                written += n < 0 ? 0 : size_t(n);
+            }
+        };
+
+        if (::ftruncate(fd, off_t(recovered.end)) != 0)
+            fail("ftruncate failed");
+        auto mdat_size = recovered.end - recovered.mdat_offset;
+        std::vector<char> header;
+        if (recovered.mdat_header_size == 16)
+        {
+            put_number(uint64_t(mdat_size), header);
+            write_at(recovered.mdat_offset + 8, header);
+        }
+        else if (mdat_size <= UINT32_MAX)
+        {
+            put_number(uint32_t(mdat_size), header);
+            write_at(recovered.mdat_offset, header);
+        }
+        else if (recovered.mdat_widenable)
+        {
+            put_number(uint32_t(1), header);
+            put_fourcc("mdat", header);
+            put_number(uint64_t(mdat_size + 8), header);
+            write_at(recovered.mdat_offset - 8, header);
+        }
+        else
+        {
+            ::close(fd);
+            throw std::runtime_error{"repair_recording: mdat too large for its size field"};
+        }
+        std::vector<char> moov;
+        write_moov(moov, recovered.moov);
+        write_at(recovered.end, moov);
+        if (::fdatasync(fd) != 0)
+            fail("fdatasync failed");
+        // moovs after the end were cut off with the tail
+        std::vector<char> free_type{'f', 'r', 'e', 'e'};
+        for (auto offset : recovered.moov_offsets)
+            if (offset < recovered.end)
+                write_at(offset + 4, free_type);
+        if (::fsync(fd) != 0)
+            fail("fsync failed");
+        ::close(fd);
+        return recovered;
+    }
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include "MP4Atom.hpp"
+
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+// ---------------------- sample lookup --------------------------
+
+namespace my_remux::mp4
+{
+    struct sample_info_t
+    {
+        uint64_t offset;
+        uint32_t size;
+        int64_t dts;
+        int64_t pts;
+        bool keyframe;
+    };
+
+    enum class sample_index_layout_t
+    {
+        full, // absolute file offset per sample, O(1) offset lookup
+        compact, // offset within the chunk per sample, O(log chunks) offset lookup
+    };
+
+    // combines stsc, co64, stsz, stts, ctts and stss of a track once, so that
+    // sample -> byte range, time -> sample and keyframe lookups don't have to
+    // rederive the chunk layout. all data is kept as structure of arrays.
+    // sample indices are 0-based, times are in the media time scale.
+    class sample_index_t
+    {
+    public:
+        sample_index_t() = default;
+
+        explicit sample_index_t(const stbl_t& stbl, sample_index_layout_t layout = sample_index_layout_t::full)
+        : _layout{layout}
+        , _sizes{stbl.stsz}
+        , _chunk_offset{stbl.co64}
+        , _stts{stbl.stts}
+        , _ctts{stbl.ctts}
+        , _keyframes{stbl.stss.keyframe_indices}
+        {
+            // stts has to cover every sample, ctts too unless it is absent
+            if (_stts.sample_count() != _sizes.size())
+                throw std::runtime_error{"sample_index_t: stts does not match stsz"};
+            if (!_ctts.empty() && _ctts.sample_count() != _sizes.size())
+                throw std::runtime_error{"sample_index_t: ctts does not match stsz"};
+            build_chunks(stbl.stsc);
+            if (layout == sample_index_layout_t::full)
+                _offsets.resize(_sizes.size());
+            else
+                _chunk_relative_offsets.resize(_sizes.size());
+            for (size_t chunk = 0; chunk < _chunk_offset.size(); ++chunk)
+            {
+                uint64_t offset = 0;
+                for (auto s = _chunk_first_sample[chunk]; s < _chunk_first_sample[chunk + 1]; ++s)
+                {
+                    if (layout == sample_index_layout_t::full)
+                    {
+                        _offsets[s] = _chunk_offset[chunk] + offset;
+                    }
+                    else
+                    {
+                        if (offset > UINT32_MAX)
+                            throw std::runtime_error{"sample_index_t: chunk too large for compact layout"};
+                        _chunk_relative_offsets[s] = uint32_t(offset);
+                    }
+                    offset += _sizes[s];
+                }
+            }
+            // stss stores 1-based sample numbers
+            for (auto& keyframe : _keyframes)
+            {
+                if (keyframe == 0)
+                    throw std::runtime_error{"sample_index_t: stss entry 0 is not a sample"};
+                keyframe -= 1;
+            }
+            std::sort(_keyframes.begin(), _keyframes.end());
+        }
+
+        sample_index_layout_t layout() const
+        {
+            return _layout;
+        }
+
+        uint32_t size() const
+        {
+            return uint32_t(_sizes.size());
+        }
+
+        uint32_t chunk_count() const
+        {
+            return uint32_t(_chunk_offset.size());
+        }
+
+        uint64_t offset(uint32_t sample) const
+        {
+            check(sample);
+            if (_layout == sample_index_layout_t::full)
+                return _offsets[sample];
+            return _chunk_offset[chunk_of(sample)] + _chunk_relative_offsets[sample];
+        }
+
+        uint32_t size(uint32_t sample) const
+        {
+            check(sample);
+            return _sizes[sample];
+        }
+
+        Box byte_range(uint32_t sample) const
+        {
+            return Box{offset(sample), size(sample), 0};
+        }
+
+        int64_t dts(uint32_t sample) const
+        {
+            check(sample);
+            return _stts.time_at(sample);
+        }
+
+        int64_t pts(uint32_t sample) const
+        {
+            check(sample);
+            return _ctts.empty() ? dts(sample) : dts(sample) + _ctts.value_at(sample);
+        }
+
+        int64_t duration(uint32_t sample) const
+        {
+            check(sample);
+            return _stts.value_at(sample);
+        }
+
+        // an empty stss is taken to mean every sample is a sync sample
+        bool is_keyframe(uint32_t sample) const
+        {
+            check(sample);
+            return _keyframes.empty() || std::binary_search(_keyframes.begin(), _keyframes.end(), sample);
+        }
+
+        sample_info_t at(uint32_t sample) const
+        {
+            return sample_info_t{offset(sample), size(sample), dts(sample), pts(sample), is_keyframe(sample)};
+        }
+
+        uint32_t chunk_of(uint32_t sample) const
+        {
+            check(sample);
+            auto it = std::upper_bound(_chunk_first_sample.begin(), _chunk_first_sample.end(), sample);
+            return uint32_t(it - _chunk_first_sample.begin()) - 1;
+        }
+
+        uint32_t chunk_first_sample(uint32_t chunk) const
+        {
+            return _chunk_first_sample.at(chunk);
+        }
+
+        uint64_t chunk_offset(uint32_t chunk) const
+        {
+            return _chunk_offset.at(chunk);
+        }
+
+        // last sample decoded at or before dts
+        uint32_t sample_at_dts(int64_t dts) const
+        {
+            if (_sizes.empty())
+                throw std::out_of_range{"sample_index_t: no samples"};
+            return uint32_t(std::min<uint64_t>(_stts.sample_at_time(dts), _sizes.size() - 1));
+        }
+
+        // last keyframe decoded at or before dts
+        std::optional<uint32_t> keyframe_before(int64_t dts) const
+        {
+            if (_sizes.empty())
+                return std::nullopt;
+            auto sample = sample_at_dts(dts);
+            if (_keyframes.empty())
+                return sample;
+            auto it = std::upper_bound(_keyframes.begin(), _keyframes.end(), sample);
+            if (it == _keyframes.begin())
+                return std::nullopt;
+            return *(it - 1);
+        }
+
+        // first keyframe at or after sample
+        std::optional<uint32_t> keyframe_after(uint32_t sample) const
+        {
+            if (sample >= _sizes.size())
+                return std::nullopt;
+            if (_keyframes.empty())
+                return sample;
+            auto it = std::lower_bound(_keyframes.begin(), _keyframes.end(), sample);
+            if (it == _keyframes.end())
+                return std::nullopt;
+            return *it;
+        }
+
+        const std::vector<uint32_t>& keyframes() const
+        {
+            return _keyframes;
+        }
+
+        const tts_table_t& stts() const
+        {
+            return _stts;
+        }
+
+        const tts_table_t& ctts() const
+        {
+            return _ctts;
+        }
+
+    private:
+        void build_chunks(const std::vector<stc_t>& stsc)
+        {
+            auto chunk_count = _chunk_offset.size();
+            _chunk_first_sample.resize(chunk_count + 1);
+            uint64_t sample = 0;
+            size_t chunk = 0;
+            for (size_t i = 0; i < stsc.size(); ++i)
+            {
+                size_t first = stsc[i].first_chunk - 1;
+                size_t last = i + 1 < stsc.size() ? stsc[i + 1].first_chunk - 1 : chunk_count;
+                if (first != chunk || last < first || last > chunk_count)
+                    throw std::runtime_error{"sample_index_t: inconsistent stsc"};
+                for (; chunk < last; ++chunk)
+                {
+                    _chunk_first_sample[chunk] = uint32_t(sample);
+                    sample += stsc[i].samples_per_chunk;
+                }
+            }
+            if (chunk != chunk_count || sample != _sizes.size())
+                throw std::runtime_error{"sample_index_t: stsc does not match stsz/co64"};
+            _chunk_first_sample[chunk_count] = uint32_t(sample);
+        }
+
+        void check(uint32_t sample) const
+        {
+            if (sample >= _sizes.size())
+                throw std::out_of_range{"sample_index_t: sample index out of range"};
+        }
+
+        sample_index_layout_t _layout = sample_index_layout_t::full;
+        std::vector<uint32_t> _sizes; // per sample
+        std::vector<uint64_t> _offsets; // per sample, full layout
+        std::vector<uint32_t> _chunk_relative_offsets; // per sample, compact layout
+        std::vector<uint32_t> _chunk_first_sample; // per chunk, plus end
+        std::vector<uint64_t> _chunk_offset; // per chunk
+        tts_table_t _stts;
+        tts_table_t _ctts;
+        std::vector<uint32_t> _keyframes; // 0-based, sorted
+    };
+}
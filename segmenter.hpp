@@ -0,0 +1,174 @@
+#pragma once
+
+#include "MP4Atom.hpp"
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// ---------------------- fragmented mp4 writing --------------------------
+
+namespace my_remux::mp4
+{
+    // one access unit handed to the segmenter, times in the track time scale.
+    // data only has to stay valid for the duration of the push call.
+    struct fragment_sample_t
+    {
+        const char* data;
+        size_t size;
+        int64_t dts;
+        int64_t pts;
+        bool keyframe;
+    };
+
+    struct segmenter_config_t
+    {
+        uint32_t track_id = 1;
+        // cut at the first keyframe once a fragment is at least this long
+        int64_t target_duration = 90000;
+        // cut regardless of keyframes once a fragment reaches this length
+        int64_t max_duration = 10 * 90000;
+        // cut once the payload would exceed this size
+        size_t max_fragment_size = 64 << 20;
+        // duration of the very last sample, which has no successor
+        uint32_t default_sample_duration = 3000;
+    };
+
+    // turns a stream of samples into moof+mdat fragments of a single track.
+    // only the samples of the fragment being built are buffered, so memory
+    // is bounded by the configured fragment limits.
+    class fmp4_segmenter_t
+    {
+    public:
+        explicit fmp4_segmenter_t(segmenter_config_t config = {})
+        : _config{config}
+        {
+        }
+
+        // writes ftyp and an empty moov announcing fragments for the track,
+        // which has to be the only one of moov
+        static size_t write_init_segment(std::vector<char>& out, moov_t moov, const segmenter_config_t& config = {})
+        {
+            if (moov.traks.size() != 1)
+                throw std::invalid_argument{"fmp4_segmenter_t: init segment needs exactly one track"};
+            if (!moov.mvex)
+                moov.mvex = mvex_t{{trex_t{config.track_id}}};
+            moov.traks.front().tkhd.track_id = config.track_id;
+            auto start_offset = out.size();
+            write_ftyp(out, {});
+            write_moov(out, moov);
+            return out.size() - start_offset;
+        }
+
+        // adds a sample. if it closes the pending fragment, the fragment is
+        // appended to out and true is returned.
+        bool push(const fragment_sample_t& sample, std::vector<char>& out)
+        {
+            bool emitted = false;
+            if (!_samples.empty())
+            {
+                _samples.back().duration = duration_to(sample.dts);
+                if (should_cut(sample))
+                {
+                    emit(out);
+                    emitted = true;
+                }
+            }
+            if (_samples.empty())
+                _first_dts = sample.dts;
+            _samples.push_back({
+                0,
+                uint32_t(sample.size),
+                sample.keyframe ? sample_depends_on_none : sample_depends_on_others | sample_is_non_sync,
+                int32_t(sample.pts - sample.dts),
+            });
+            _last_dts = sample.dts;
+            _payload.insert(_payload.end(), sample.data, sample.data + sample.size);
+            return emitted;
+        }
+
+        // writes out whatever is pending, e.g. at the end of the stream
+        bool flush(std::vector<char>& out)
+        {
+            if (_samples.empty())
+                return false;
+            _samples.back().duration = _config.default_sample_duration;
+            emit(out);
+            return true;
+        }
+
+        uint32_t sequence_number() const
+        {
+            return _sequence_number;
+        }
+
+        size_t pending_samples() const
+        {
+            return _samples.size();
+        }
+
+    private:
+        struct pending_sample_t
+        {
+            uint32_t duration;
+            uint32_t size;
+            uint32_t flags;
+            int32_t composition_time_offset;
+        };
+
+        bool should_cut(const fragment_sample_t& sample) const
+        {
+            auto elapsed = sample.dts - _first_dts;
+            return (sample.keyframe && elapsed >= _config.target_duration) ||
+                   elapsed >= _config.max_duration ||
+                   _payload.size() + sample.size > _config.max_fragment_size;
+        }
+
+        uint32_t duration_to(int64_t dts) const
+        {
+            if (dts < _last_dts)
+                throw std::runtime_error{"fmp4_segmenter_t: decode times must not decrease"};
+            return uint32_t(dts - _last_dts);
+        }
+
+        void emit(std::vector<char>& out)
+        {
+            if (_first_dts < 0)
+                throw std::runtime_error{"fmp4_segmenter_t: negative decode time"};
+            moof_t moof{};
+            moof.mfhd.sequence_number = ++_sequence_number;
+            traf_t traf{};
+            traf.tfhd.track_ID = _config.track_id;
+            traf.tfhd.default_base_is_moof = true;
+            traf.tfdt = tfdt_t{uint64_t(_first_dts)};
+            trun_t trun{};
+            trun.sample_count = uint32_t(_samples.size());
+            trun.data_offset = 0;
+            trun.samples.reserve(_samples.size());
+            for (auto& sample : _samples)
+                trun.samples.push_back({sample.duration, sample.size, sample.flags, sample.composition_time_offset});
+            traf.trun.push_back(std::move(trun));
+            moof.traf.push_back(std::move(traf));
+
+            // the data offset is relative to the moof start
+            auto moof_size = size_of_moof(moof);
+            moof.traf.front().trun.front().data_offset = int32_t(moof_size + atom_header_size);
+            reserve_more(out, moof_size + atom_header_size + _payload.size());
+            write_moof(out, moof);
+
+            auto mdat_offset = begin_atom(out, "mdat");
+            out.insert(out.end(), _payload.begin(), _payload.end());
+            finish_atom(out, mdat_offset);
+
+            _samples.clear();
+            _payload.clear();
+        }
+
+        segmenter_config_t _config;
+        uint32_t _sequence_number = 0;
+        int64_t _first_dts = 0;
+        int64_t _last_dts = 0;
+        std::vector<pending_sample_t> _samples;
+        std::vector<char> _payload;
+    };
+}
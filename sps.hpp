@@ -0,0 +1,476 @@
+#pragma once
+
+#include "bit_reader.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// ---------------------- sequence parameter sets --------------------------
+// the parts of h.264 / h.265 sps nalus needed to describe a track: picture
+// size after cropping, bit depth, profile / level and vui timing.
+
+namespace game_on
+{
+    // vui timing info, frame_rate() is 0 without it
+    struct vui_timing_t
+    {
+        bool present = false;
+        uint32_t num_units_in_tick = 0;
+        uint32_t time_scale = 0;
+        bool fixed_frame_rate = false;
+    };
+
+    struct crop_t
+    {
+        // in luma samples
+        uint32_t left = 0;
+        uint32_t right = 0;
+        uint32_t top = 0;
+        uint32_t bottom = 0;
+    };
+
+    struct h264_sps_t
+    {
+        uint8_t profile_idc = 0;
+        uint8_t constraint_flags = 0;
+        uint8_t level_idc = 0;
+        uint32_t sps_id = 0;
+        uint32_t chroma_format_idc = 1;
+        bool separate_colour_plane = false;
+        uint32_t bit_depth_luma = 8;
+        uint32_t bit_depth_chroma = 8;
+        uint32_t log2_max_frame_num = 4;
+        uint32_t pic_order_cnt_type = 0;
+        uint32_t log2_max_pic_order_cnt_lsb = 4;
+        uint32_t max_num_ref_frames = 0;
+        bool frame_mbs_only = true;
+        uint32_t coded_width = 0; // in luma samples, before cropping
+        uint32_t coded_height = 0;
+        crop_t crop;
+        uint32_t width = 0; // displayed size
+        uint32_t height = 0;
+        uint16_t sar_width = 1;
+        uint16_t sar_height = 1;
+        vui_timing_t timing;
+
+        // time_scale counts field ticks, a frame takes two of them
+        double frame_rate() const
+        {
+            if (!timing.present || timing.num_units_in_tick == 0)
+                return 0;
+            return double(timing.time_scale) / (2.0 * timing.num_units_in_tick);
+        }
+    };
+
+    struct h265_sps_t
+    {
+        uint8_t vps_id = 0;
+        uint8_t max_sub_layers = 1;
+        bool temporal_id_nesting = false;
+        // general profile_tier_level, laid out as in hvcC
+        uint8_t general_profile_space = 0;
+        bool general_tier_flag = false;
+        uint8_t general_profile_idc = 0;
+        uint32_t general_profile_compatibility_flags = 0;
+        uint64_t general_constraint_indicator_flags = 0; // 48 bits
+        uint8_t general_level_idc = 0;
+        uint32_t sps_id = 0;
+        uint32_t chroma_format_idc = 1;
+        bool separate_colour_plane = false;
+        uint32_t coded_width = 0;
+        uint32_t coded_height = 0;
+        crop_t crop;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t bit_depth_luma = 8;
+        uint32_t bit_depth_chroma = 8;
+        uint32_t log2_max_pic_order_cnt_lsb = 4;
+        uint16_t sar_width = 1;
+        uint16_t sar_height = 1;
+        vui_timing_t timing;
+
+        double frame_rate() const
+        {
+            if (!timing.present || timing.num_units_in_tick == 0)
+                return 0;
+            return double(timing.time_scale) / timing.num_units_in_tick;
+        }
+    };
+
+    namespace detail
+    {
+        // sub_width_c / sub_height_c of table 6-1, 1 for monochrome
+        inline uint32_t sub_width(uint32_t chroma_array_type)
+        {
+            return chroma_array_type == 1 || chroma_array_type == 2 ? 2 : 1;
+        }
+
+        inline uint32_t sub_height(uint32_t chroma_array_type)
+        {
+            return chroma_array_type == 1 ? 2 : 1;
+        }
+
+        inline void skip_h264_scaling_list(bit_reader_t& bits, int size)
+        {
+            int last_scale = 8;
+            int next_scale = 8;
+            for (int i = 0; i < size && next_scale != 0; ++i)
+            {
+                next_scale = (last_scale + bits.read_se() + 256) % 256;
+                last_scale = next_scale == 0 ? last_scale : next_scale;
+            }
+        }
+
+        inline void read_aspect_ratio(bit_reader_t& bits, uint16_t& sar_width, uint16_t& sar_height)
+        {
+            static constexpr uint8_t sar_table[17][2] = {
+                {0, 0}, {1, 1}, {12, 11}, {10, 11}, {16, 11}, {40, 33}, {24, 11}, {20, 11}, {32, 11},
+                {80, 33}, {18, 11}, {15, 11}, {64, 33}, {160, 99}, {4, 3}, {3, 2}, {2, 1},
+            };
+            auto idc = bits.read_bits(8);
+            if (idc == 255) // extended sar
+            {
+                sar_width = uint16_t(bits.read_bits(16));
+                sar_height = uint16_t(bits.read_bits(16));
+            }
+            else if (idc > 0 && idc < 17)
+            {
+                sar_width = sar_table[idc][0];
+                sar_height = sar_table[idc][1];
+            }
+        }
+
+        // the vui fields in front of the timing info are the same for both codecs
+        inline void skip_video_signal_info(bit_reader_t& bits)
+        {
+            if (bits.read_bit()) // overscan_info_present_flag
+                bits.read_bit();
+            if (bits.read_bit()) // video_signal_type_present_flag
+            {
+                bits.skip_bits(4); // video_format, video_full_range_flag
+                if (bits.read_bit()) // colour_description_present_flag
+                    bits.skip_bits(24);
+            }
+            if (bits.read_bit()) // chroma_loc_info_present_flag
+            {
+                bits.read_ue();
+                bits.read_ue();
+            }
+        }
+
+        inline void read_timing(bit_reader_t& bits, vui_timing_t& timing)
+        {
+            timing.present = true;
+            timing.num_units_in_tick = bits.read_bits(32);
+            timing.time_scale = bits.read_bits(32);
+        }
+    }
+
+    // parses an h.264 sps nalu, starting at its header byte and still
+    // containing emulation prevention bytes (h.264 7.3.2.1.1, e.1.1)
+    inline h264_sps_t parse_h264_sps(const char* nalu, size_t size)
+    {
+        if (size < 4 || (uint8_t(nalu[0]) & 0x1f) != 7)
+            throw std::invalid_argument{"parse_h264_sps: not an sps nalu"};
+        auto rbsp = nalu_to_rbsp(nalu + 1, size - 1);
+        bit_reader_t bits{rbsp};
+        h264_sps_t sps;
+        sps.profile_idc = uint8_t(bits.read_bits(8));
+        sps.constraint_flags = uint8_t(bits.read_bits(8));
+        sps.level_idc = uint8_t(bits.read_bits(8));
+        sps.sps_id = bits.read_ue();
+        switch (sps.profile_idc)
+        {
+        case 100: case 110: case 122: case 244: case 44: case 83:
+        case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+            sps.chroma_format_idc = bits.read_ue();
+            if (sps.chroma_format_idc == 3)
+                sps.separate_colour_plane = bits.read_bit();
+            sps.bit_depth_luma = bits.read_ue() + 8;
+            sps.bit_depth_chroma = bits.read_ue() + 8;
+            bits.read_bit(); // qpprime_y_zero_transform_bypass_flag
+            if (bits.read_bit()) // seq_scaling_matrix_present_flag
+            {
+                for (int i = 0; i < (sps.chroma_format_idc != 3 ? 8 : 12); ++i)
+                    if (bits.read_bit())
+                        detail::skip_h264_scaling_list(bits, i < 6 ? 16 : 64);
+            }
+            break;
+        default:
+            break;
+        }
+        sps.log2_max_frame_num = bits.read_ue() + 4;
+        sps.pic_order_cnt_type = bits.read_ue();
+        if (sps.pic_order_cnt_type == 0)
+        {
+            sps.log2_max_pic_order_cnt_lsb = bits.read_ue() + 4;
+        }
+        else if (sps.pic_order_cnt_type == 1)
+        {
+            bits.read_bit(); // delta_pic_order_always_zero_flag
+            bits.read_se(); // offset_for_non_ref_pic
+            bits.read_se(); // offset_for_top_to_bottom_field
+            auto cycle = bits.read_ue();
+            for (uint32_t i = 0; i < cycle; ++i)
+                bits.read_se();
+        }
+        sps.max_num_ref_frames = bits.read_ue();
+        bits.read_bit(); // gaps_in_frame_num_value_allowed_flag
+        auto width_in_mbs = uint64_t(bits.read_ue()) + 1;
+        auto height_in_map_units = uint64_t(bits.read_ue()) + 1;
+        sps.frame_mbs_only = bits.read_bit();
+        if (!sps.frame_mbs_only)
+            bits.read_bit(); // mb_adaptive_frame_field_flag
+        bits.read_bit(); // direct_8x8_inference_flag
+        sps.coded_width = uint32_t(width_in_mbs * 16);
+        sps.coded_height = uint32_t(height_in_map_units * 16 * (2 - sps.frame_mbs_only));
+        if (bits.read_bit()) // frame_cropping_flag
+        {
+            auto chroma_array_type = sps.separate_colour_plane ? 0 : sps.chroma_format_idc;
+            auto unit_x = detail::sub_width(chroma_array_type);
+            auto unit_y = detail::sub_height(chroma_array_type) * (2 - sps.frame_mbs_only);
+            sps.crop.left = bits.read_ue() * unit_x;
+            sps.crop.right = bits.read_ue() * unit_x;
+            sps.crop.top = bits.read_ue() * unit_y;
+            sps.crop.bottom = bits.read_ue() * unit_y;
+            if (uint64_t(sps.crop.left) + sps.crop.right >= sps.coded_width ||
+                uint64_t(sps.crop.top) + sps.crop.bottom >= sps.coded_height)
+                throw std::runtime_error{"parse_h264_sps: cropping exceeds picture size"};
+        }
+        sps.width = sps.coded_width - sps.crop.left - sps.crop.right;
+        sps.height = sps.coded_height - sps.crop.top - sps.crop.bottom;
+        if (bits.read_bit()) // vui_parameters_present_flag
+        {
+            if (bits.read_bit()) // aspect_ratio_info_present_flag
+                detail::read_aspect_ratio(bits, sps.sar_width, sps.sar_height);
+            detail::skip_video_signal_info(bits);
+            if (bits.read_bit()) // timing_info_present_flag
+            {
+                detail::read_timing(bits, sps.timing);
+                sps.timing.fixed_frame_rate = bits.read_bit();
+            }
+            // hrd parameters and bitstream restrictions are not needed
+        }
+        return sps;
+    }
+
+    namespace detail
+    {
+        // delta pocs of one short term reference picture set (h.265 7.4.8)
+        struct st_ref_pic_set_t
+        {
+            std::vector<int32_t> negative; // DeltaPocS0
+            std::vector<int32_t> positive; // DeltaPocS1
+        };
+
+        inline st_ref_pic_set_t read_st_ref_pic_set(bit_reader_t& bits, const std::vector<st_ref_pic_set_t>& previous)
+        {
+            st_ref_pic_set_t set;
+            auto index = previous.size();
+            if (index != 0 && bits.read_bit()) // inter_ref_pic_set_prediction_flag
+            {
+                // in the sps the reference is always the previous set
+                auto& ref = previous.back();
+                auto sign = bits.read_bit();
+                auto delta_rps = (1 - 2 * int32_t(sign)) * (int32_t(bits.read_ue()) + 1);
+                auto ref_count = ref.negative.size() + ref.positive.size();
+                std::vector<bool> use_delta(ref_count + 1, true);
+                for (size_t j = 0; j <= ref_count; ++j)
+                    if (!bits.read_bit()) // used_by_curr_pic_flag
+                        use_delta[j] = bits.read_bit();
+                auto negative_count = ref.negative.size();
+                // (7-61) and (7-62)
+                for (size_t j = ref.positive.size(); j-- > 0;)
+                {
+                    auto poc = ref.positive[j] + delta_rps;
+                    if (poc < 0 && use_delta[negative_count + j])
+                        set.negative.push_back(poc);
+                }
+                if (delta_rps < 0 && use_delta[ref_count])
+                    set.negative.push_back(delta_rps);
+                for (size_t j = 0; j < negative_count; ++j)
+                {
+                    auto poc = ref.negative[j] + delta_rps;
+                    if (poc < 0 && use_delta[j])
+                        set.negative.push_back(poc);
+                }
+                for (size_t j = negative_count; j-- > 0;)
+                {
+                    auto poc = ref.negative[j] + delta_rps;
+                    if (poc > 0 && use_delta[j])
+                        set.positive.push_back(poc);
+                }
+                if (delta_rps > 0 && use_delta[ref_count])
+                    set.positive.push_back(delta_rps);
+                for (size_t j = 0; j < ref.positive.size(); ++j)
+                {
+                    auto poc = ref.positive[j] + delta_rps;
+                    if (poc > 0 && use_delta[negative_count + j])
+                        set.positive.push_back(poc);
+                }
+                return set;
+            }
+            auto negative_count = bits.read_ue();
+            auto positive_count = bits.read_ue();
+            if (negative_count > 16 || positive_count > 16)
+                throw std::runtime_error{"parse_h265_sps: too many reference pictures"};
+            int32_t poc = 0;
+            for (uint32_t i = 0; i < negative_count; ++i)
+            {
+                poc -= int32_t(bits.read_ue()) + 1;
+                bits.read_bit(); // used_by_curr_pic_s0_flag
+                set.negative.push_back(poc);
+            }
+            poc = 0;
+            for (uint32_t i = 0; i < positive_count; ++i)
+            {
+                poc += int32_t(bits.read_ue()) + 1;
+                bits.read_bit(); // used_by_curr_pic_s1_flag
+                set.positive.push_back(poc);
+            }
+            return set;
+        }
+
+        inline void skip_h265_scaling_list_data(bit_reader_t& bits)
+        {
+            for (int size_id = 0; size_id < 4; ++size_id)
+            {
+                for (int matrix_id = 0; matrix_id < 6; matrix_id += size_id == 3 ? 3 : 1)
+                {
+                    if (!bits.read_bit()) // scaling_list_pred_mode_flag
+                    {
+                        bits.read_ue(); // scaling_list_pred_matrix_id_delta
+                        continue;
+                    }
+                    auto coefficients = std::min(64, 1 << (4 + (size_id << 1)));
+                    if (size_id > 1)
+                        bits.read_se(); // scaling_list_dc_coef_minus8
+                    for (int i = 0; i < coefficients; ++i)
+                        bits.read_se();
+                }
+            }
+        }
+    }
+
+    // parses an h.265 sps nalu, starting at its two byte header and still
+    // containing emulation prevention bytes (h.265 7.3.2.2.1, e.2.1)
+    inline h265_sps_t parse_h265_sps(const char* nalu, size_t size)
+    {
+        if (size < 3 || ((uint8_t(nalu[0]) >> 1) & 0x3f) != 33)
+            throw std::invalid_argument{"parse_h265_sps: not an sps nalu"};
+        auto rbsp = nalu_to_rbsp(nalu + 2, size - 2);
+        bit_reader_t bits{rbsp};
+        h265_sps_t sps;
+        sps.vps_id = uint8_t(bits.read_bits(4));
+        sps.max_sub_layers = uint8_t(bits.read_bits(3) + 1);
+        sps.temporal_id_nesting = bits.read_bit();
+        // profile_tier_level(1, sps_max_sub_layers_minus1)
+        sps.general_profile_space = uint8_t(bits.read_bits(2));
+        sps.general_tier_flag = bits.read_bit();
+        sps.general_profile_idc = uint8_t(bits.read_bits(5));
+        sps.general_profile_compatibility_flags = bits.read_bits(32);
+        sps.general_constraint_indicator_flags = (uint64_t(bits.read_bits(16)) << 32) | bits.read_bits(32);
+        sps.general_level_idc = uint8_t(bits.read_bits(8));
+        std::vector<bool> sub_layer_profile(sps.max_sub_layers), sub_layer_level(sps.max_sub_layers);
+        for (int i = 0; i + 1 < sps.max_sub_layers; ++i)
+        {
+            sub_layer_profile[i] = bits.read_bit();
+            sub_layer_level[i] = bits.read_bit();
+        }
+        if (sps.max_sub_layers > 1)
+            bits.skip_bits(2 * (9 - sps.max_sub_layers)); // reserved_zero_2bits
+        for (int i = 0; i + 1 < sps.max_sub_layers; ++i)
+        {
+            if (sub_layer_profile[i])
+                bits.skip_bits(88);
+            if (sub_layer_level[i])
+                bits.skip_bits(8);
+        }
+        sps.sps_id = bits.read_ue();
+        sps.chroma_format_idc = bits.read_ue();
+        if (sps.chroma_format_idc == 3)
+            sps.separate_colour_plane = bits.read_bit();
+        sps.coded_width = bits.read_ue();
+        sps.coded_height = bits.read_ue();
+        if (bits.read_bit()) // conformance_window_flag
+        {
+            auto chroma_array_type = sps.separate_colour_plane ? 0 : sps.chroma_format_idc;
+            auto unit_x = detail::sub_width(chroma_array_type);
+            auto unit_y = detail::sub_height(chroma_array_type);
+            sps.crop.left = bits.read_ue() * unit_x;
+            sps.crop.right = bits.read_ue() * unit_x;
+            sps.crop.top = bits.read_ue() * unit_y;
+            sps.crop.bottom = bits.read_ue() * unit_y;
+            if (uint64_t(sps.crop.left) + sps.crop.right >= sps.coded_width ||
+                uint64_t(sps.crop.top) + sps.crop.bottom >= sps.coded_height)
+                throw std::runtime_error{"parse_h265_sps: conformance window exceeds picture size"};
+        }
+        sps.width = sps.coded_width - sps.crop.left - sps.crop.right;
+        sps.height = sps.coded_height - sps.crop.top - sps.crop.bottom;
+        sps.bit_depth_luma = bits.read_ue() + 8;
+        sps.bit_depth_chroma = bits.read_ue() + 8;
+        sps.log2_max_pic_order_cnt_lsb = bits.read_ue() + 4;
+        if (sps.log2_max_pic_order_cnt_lsb > 16)
+            throw std::runtime_error{"parse_h265_sps: invalid log2_max_pic_order_cnt_lsb"};
+        auto ordering_info_for_all = bits.read_bit();
+        for (int i = ordering_info_for_all ? 0 : sps.max_sub_layers - 1; i < sps.max_sub_layers; ++i)
+        {
+            bits.read_ue(); // sps_max_dec_pic_buffering_minus1
+            bits.read_ue(); // sps_max_num_reorder_pics
+            bits.read_ue(); // sps_max_latency_increase_plus1
+        }
+        bits.read_ue(); // log2_min_luma_coding_block_size_minus3
+        bits.read_ue(); // log2_diff_max_min_luma_coding_block_size
+        bits.read_ue(); // log2_min_luma_transform_block_size_minus2
+        bits.read_ue(); // log2_diff_max_min_luma_transform_block_size
+        bits.read_ue(); // max_transform_hierarchy_depth_inter
+        bits.read_ue(); // max_transform_hierarchy_depth_intra
+        if (bits.read_bit() && bits.read_bit()) // scaling_list_enabled_flag, sps_scaling_list_data_present_flag
+            detail::skip_h265_scaling_list_data(bits);
+        bits.read_bit(); // amp_enabled_flag
+        bits.read_bit(); // sample_adaptive_offset_enabled_flag
+        if (bits.read_bit()) // pcm_enabled_flag
+        {
+            bits.skip_bits(8); // pcm bit depths
+            bits.read_ue(); // log2_min_pcm_luma_coding_block_size_minus3
+            bits.read_ue(); // log2_diff_max_min_pcm_luma_coding_block_size
+            bits.read_bit(); // pcm_loop_filter_disabled_flag
+        }
+        auto st_ref_pic_set_count = bits.read_ue();
+        if (st_ref_pic_set_count > 64)
+            throw std::runtime_error{"parse_h265_sps: too many short term reference picture sets"};
+        std::vector<detail::st_ref_pic_set_t> st_ref_pic_sets;
+        for (uint32_t i = 0; i < st_ref_pic_set_count; ++i)
+            st_ref_pic_sets.push_back(detail::read_st_ref_pic_set(bits, st_ref_pic_sets));
+        if (bits.read_bit()) // long_term_ref_pics_present_flag
+        {
+            auto count = bits.read_ue();
+            for (uint32_t i = 0; i < count; ++i)
+                bits.skip_bits(sps.log2_max_pic_order_cnt_lsb + 1); // lt_ref_pic_poc_lsb_sps, used_by_curr_pic_lt_sps_flag
+        }
+        bits.read_bit(); // sps_temporal_mvp_enabled_flag
+        bits.read_bit(); // strong_intra_smoothing_enabled_flag
+        if (bits.read_bit()) // vui_parameters_present_flag
+        {
+            if (bits.read_bit()) // aspect_ratio_info_present_flag
+                detail::read_aspect_ratio(bits, sps.sar_width, sps.sar_height);
+            detail::skip_video_signal_info(bits);
+            bits.read_bit(); // neutral_chroma_indication_flag
+            bits.read_bit(); // field_seq_flag
+            bits.read_bit(); // frame_field_info_present_flag
+            if (bits.read_bit()) // default_display_window_flag
+            {
+                for (int i = 0; i < 4; ++i)
+                    bits.read_ue();
+            }
+            if (bits.read_bit()) // vui_timing_info_present_flag
+            {
+                detail::read_timing(bits, sps.timing);
+                // hrd parameters and bitstream restrictions are not needed
+            }
+        }
+        return sps;
+    }
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <vector>
+
+// ---------------------- run length timing tables --------------------------
+
+namespace my_remux::mp4
+{
+    struct tts_t
+    {
+        uint32_t count;
+        int32_t duration;
+    };
+
+    // stts/ctts kept as (count, value) runs, as stored in the file.
+    // prefix sums over the runs allow O(log runs) lookups in both directions,
+    // so memory scales with the number of runs instead of samples.
+    // for stts the value is the sample duration and time_at(sample) is the dts,
+    // for ctts the value is the dts -> pts offset.
+    class tts_table_t
+    {
+    public:
+        tts_table_t() = default;
+
+        tts_table_t(std::vector<tts_t> runs)
+        {
+            _runs.reserve(runs.size());
+            _first_sample.reserve(runs.size());
+            _first_time.reserve(runs.size());
+            for (auto&& run : runs)
+                push_run(run);
+        }
+
+        tts_table_t(std::initializer_list<tts_t> runs)
+        : tts_table_t(std::vector<tts_t>(runs))
+        {
+        }
+
+        // builds the table from one value per sample
+        static tts_table_t from_values(const std::vector<int32_t>& values)
+        {
+            tts_table_t result;
+            for (auto value : values)
+                result.push_back(value);
+            return result;
+        }
+
+        // appends a single sample, extending the last run if possible
+        void push_back(int32_t value)
+        {
+            push_run({1, value});
+        }
+
+        // appends count samples of the same value
+        void push_run(tts_t run)
+        {
+            if (run.count == 0)
+                return;
+            if (!_runs.empty() && _runs.back().duration == run.duration)
+            {
+                _runs.back().count += run.count;
+            }
+            else
+            {
+                _runs.push_back(run);
+                _first_sample.push_back(_sample_count);
+                _first_time.push_back(_total);
+            }
+            _sample_count += run.count;
+            _total += int64_t(run.count) * run.duration;
+        }
+
+        void clear()
+        {
+            *this = tts_table_t{};
+        }
+
+        const std::vector<tts_t>& runs() const
+        {
+            return _runs;
+        }
+
+        bool empty() const
+        {
+            return _sample_count == 0;
+        }
+
+        uint64_t sample_count() const
+        {
+            return _sample_count;
+        }
+
+        // sum of all values, i.e. the track duration for stts
+        int64_t total() const
+        {
+            return _total;
+        }
+
+        int32_t value_at(uint64_t sample) const
+        {
+            return _runs[run_of_sample(sample)].duration;
+        }
+
+        // sum of the values of all samples before sample
+        int64_t time_at(uint64_t sample) const
+        {
+            if (sample >= _sample_count)
+                return _total;
+            auto run = run_of_sample(sample);
+            return _first_time[run] + int64_t(sample - _first_sample[run]) * _runs[run].duration;
+        }
+
+        // index of the last sample starting at or before time, clamped to the
+        // valid sample range. only meaningful for non negative values (stts).
+        uint64_t sample_at_time(int64_t time) const
+        {
+            if (_runs.empty())
+                throw std::out_of_range{"tts_table_t: empty table"};
+            auto it = std::upper_bound(_first_time.begin(), _first_time.end(), time);
+            if (it == _first_time.begin())
+                return 0;
+            size_t run = (it - _first_time.begin()) - 1;
+            auto& entry = _runs[run];
+            uint64_t offset = entry.duration > 0 ? uint64_t((time - _first_time[run]) / entry.duration) : 0;
+            return _first_sample[run] + std::min<uint64_t>(offset, entry.count - 1);
+        }
+
+        // the per sample representation, mostly for debugging
+        std::vector<int32_t> expand() const
+        {
+            std::vector<int32_t> values;
+            values.reserve(_sample_count);
+            for (auto&& run : _runs)
+                values.insert(values.end(), run.count, run.duration);
+            return values;
+        }
+
+    private:
+        size_t run_of_sample(uint64_t sample) const
+        {
+            if (sample >= _sample_count)
+                throw std::out_of_range{"tts_table_t: sample index out of range"};
+            auto it = std::upper_bound(_first_sample.begin(), _first_sample.end(), sample);
+            return (it - _first_sample.begin()) - 1;
+        }
+
+        std::vector<tts_t> _runs;
+        std::vector<uint64_t> _first_sample; // per run
+        std::vector<int64_t> _first_time; // per run
+        uint64_t _sample_count = 0;
+        int64_t _total = 0;
+    };
+}
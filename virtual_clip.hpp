@@ -0,0 +1,261 @@
+#pragma once
+
+#include "MP4Atom.hpp"
+#include "sample_index.hpp"
+#include "output_segments.hpp"
+#include "interleave.hpp"
+#include "fast_start.hpp"
+#include "edit_timeline.hpp"
+#include "gop_index.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+// ---------------------- virtual clips --------------------------
+// a clip of a long recording is a new ftyp+moov followed by byte ranges of
+// the source. only the header is generated, so serving a clip costs time
+// proportional to the moov, not to the payload, and any byte range of the
+// clip can be answered without materializing it.
+
+namespace my_remux::mp4
+{
+    // a generated file: owned header bytes and references into sources,
+    // with the output offset of every segment for range lookups
+    class virtual_file_t
+    {
+    public:
+        virtual_file_t() = default;
+
+        explicit virtual_file_t(segment_list_t segments)
+        : _segments{std::move(segments)}
+        {
+            _starts.reserve(_segments.segments().size());
+            uint64_t offset = 0;
+            for (auto& segment : _segments.segments())
+            {
+                _starts.push_back(offset);
+                offset += segment_size(segment);
+            }
+        }
+
+        uint64_t size() const
+        {
+            return _segments.size();
+        }
+
+        const segment_list_t& segments() const
+        {
+            return _segments;
+        }
+
+        // bytes [offset, offset + length) of the file. memory segments of the
+        // result point into this object, which has to outlive them.
+        segment_list_t range(uint64_t offset, uint64_t length) const
+        {
+            if (offset > size() || length > size() - offset)
+                throw std::out_of_range{"virtual_file_t: range exceeds the file"};
+            segment_list_t result;
+            auto& segments = _segments.segments();
+            auto i = size_t(std::upper_bound(_starts.begin(), _starts.end(), offset) - _starts.begin()) - 1;
+            for (; length > 0; ++i)
+            {
+                auto skip = offset - _starts[i];
+                auto take = std::min(length, segment_size(segments[i]) - skip);
+                if (auto bytes = std::get_if<std::vector<char>>(&segments[i]))
+                {
+                    result.append(byte_span_t{bytes->data() + skip, size_t(take)});
+                }
+                else if (auto span = std::get_if<byte_span_t>(&segments[i]))
+                {
+                    result.append(span->subspan(skip, take));
+                }
+                else
+                {
+                    auto& source = std::get<file_range_t>(segments[i]);
+                    result.append(file_range_t{source.fd, source.offset + skip, take});
+                }
+                offset += take;
+                length -= take;
+            }
+            return result;
+        }
+
+    private:
+        segment_list_t _segments;
+        std::vector<uint64_t> _starts; // output offset per segment
+    };
+
+    struct byte_range_t
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    // resolves a single range of an http Range header (rfc 9110 14.1.2:
+    // "bytes=first-last", "bytes=first-" or "bytes=-suffix") against a
+    // resource of the given size. multiple ranges, malformed headers and
+    // unsatisfiable ranges yield nothing; the caller answers with the whole
+    // resource or 416.
+    inline std::optional<byte_range_t> parse_http_range(std::string_view header, uint64_t size)
+    {
+        constexpr std::string_view unit = "bytes=";
+        if (header.substr(0, unit.size()) != unit)
+            return std::nullopt;
+        header.remove_prefix(unit.size());
+        auto dash = header.find('-');
+        if (dash == std::string_view::npos || header.find(',') != std::string_view::npos)
+            return std::nullopt;
+        auto parse = [](std::string_view text, uint64_t& value) {
+            auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+            return !text.empty() && error == std::errc{} && end == text.data() + text.size();
+        };
+        auto first_text = header.substr(0, dash);
+        auto last_text = header.substr(dash + 1);
+        uint64_t first = 0;
+        uint64_t last = 0;
+        if (first_text.empty())
+        {
+            if (!parse(last_text, last) || last == 0 || size == 0)
+                return std::nullopt;
+            auto length = std::min(last, size);
+            return byte_range_t{size - length, length};
+        }
+        if (!parse(first_text, first) || first >= size)
+            return std::nullopt;
+        if (last_text.empty())
+            return byte_range_t{first, size - first};
+        if (!parse(last_text, last) || last < first)
+            return std::nullopt;
+        return byte_range_t{first, std::min(last, size - 1) - first + 1};
+    }
+
+    namespace detail
+    {
+        // values of samples [first, last) of a timing table
+        inline tts_table_t slice_tts(const tts_table_t& table, uint64_t first, uint64_t last)
+        {
+            tts_table_t result;
+            uint64_t run_start = 0;
+            for (auto& run : table.runs())
+            {
+                auto begin = std::max(first, run_start);
+                auto end = std::min(last, run_start + run.count);
+                if (begin < end)
+                    result.push_run({uint32_t(end - begin), run.duration});
+                run_start += run.count;
+                if (run_start >= last)
+                    break;
+            }
+            return result;
+        }
+    }
+
+    // cuts [start, end) of the source, in the movie time scale, into a new
+    // fast start file. the edit lists of the source are cut to the range,
+    // every track starts at the keyframe presented at or before the clip
+    // start and the edits hide the lead-in, so playback begins exactly at
+    // start. chunk offsets of source are absolute offsets in source_fd.
+    // tracks without samples in the range are left out.
+    inline virtual_file_t make_clip(const moov_t& source, int source_fd, int64_t start, int64_t end,
+                                    const interleave_config_t& interleave = {}, const ftyp_t& ftyp = {})
+    {
+        if (start < 0 || end <= start)
+            throw std::invalid_argument{"make_clip: invalid time range"};
+        auto movie_scale = source.mvhd.time_scale;
+        moov_t clip;
+        clip.mvhd = source.mvhd;
+        clip.mvhd.duration = 0;
+        std::vector<sample_index_t> indices;
+        for (auto& trak : source.traks)
+        {
+            auto& stbl = trak.mdia.minf.stbl;
+            sample_index_t index{stbl};
+            if (index.size() == 0)
+                continue;
+
+            // the edits overlapping the clip, cut to it, and the media
+            // range they show
+            edit_timeline_t timeline{trak, movie_scale};
+            std::vector<timeline_edit_t> edits;
+            int64_t media_start = INT64_MAX;
+            int64_t media_end = INT64_MIN;
+            for (auto& edit : timeline.edits())
+            {
+                auto from = std::max(start, edit.movie_start);
+                auto to = std::min(end, edit.movie_end());
+                if (from >= to)
+                    continue;
+                timeline_edit_t cut{from - start, to - from, timeline_edit_t::empty, edit.dwell};
+                if (!edit.is_empty())
+                {
+                    cut.media_start = *timeline.media_time(from);
+                    auto last_media = edit.dwell ? cut.media_start : *timeline.media_time(to - 1);
+                    media_start = std::min(media_start, cut.media_start);
+                    media_end = std::max(media_end, last_media + 1);
+                }
+                edits.push_back(cut);
+            }
+            if (media_start >= media_end || media_end <= index.dts(0))
+                continue;
+            // decoding starts at the keyframe presented at or before the
+            // clip start, so the samples are found by presentation time
+            gop_index_t gops{index};
+            if (gops.size() == 0)
+                continue;
+            auto first = gops.seek(media_start).decode_sample;
+            auto last = index.sample_at_dts(media_end - 1) + 1;
+            if (first >= last)
+                continue;
+
+            trak_t clipped;
+            clipped.tkhd = trak.tkhd;
+            clipped.mdia.mdhd = trak.mdia.mdhd;
+            clipped.mdia.hdlr = trak.mdia.hdlr;
+            clipped.mdia.minf.media_header = trak.mdia.minf.media_header;
+            clipped.mdia.minf.dinf = trak.mdia.minf.dinf;
+            auto& out = clipped.mdia.minf.stbl;
+            out.stsd = stbl.stsd;
+            out.stts = detail::slice_tts(stbl.stts, first, last);
+            if (!stbl.ctts.empty())
+                out.ctts = detail::slice_tts(stbl.ctts, first, last);
+            for (auto keyframe : index.keyframes())
+                if (keyframe >= first && keyframe < last)
+                    out.stss.keyframe_indices.push_back(keyframe - first + 1);
+            // one chunk per sample pointing into the source, which is what
+            // the source index of fast_start_segments reads back
+            out.stsz.assign(stbl.stsz.begin() + first, stbl.stsz.begin() + last);
+            out.stsc = {{1, 1, 1}};
+            out.co64.reserve(last - first);
+            for (auto sample = first; sample < last; ++sample)
+                out.co64.push_back(index.offset(sample));
+            indices.emplace_back(out);
+
+            // media time 0 of the clip is the dts of the first sample
+            auto shift = index.dts(first);
+            for (auto& edit : edits)
+            {
+                auto media_time = edit.is_empty() ? edit.media_start : std::max<int64_t>(0, edit.media_start - shift);
+                clipped.edts.elst.push_back({uint64_t(edit.movie_duration), uint64_t(media_time)});
+                if (edit.dwell)
+                    clipped.edts.elst.back().rate = fixed_point_t<0x10000, int32_t>::with_count(0);
+            }
+            clipped.tkhd.duration = uint64_t(edits.back().movie_end());
+            clipped.mdia.mdhd.duration = uint64_t(out.stts.total());
+            clip.mvhd.duration = std::max(clip.mvhd.duration, clipped.tkhd.duration);
+            clip.traks.push_back(std::move(clipped));
+        }
+        if (clip.traks.empty())
+            throw std::invalid_argument{"make_clip: no samples in the time range"};
+
+        std::vector<track_source_t> sources;
+        for (auto& index : indices)
+            sources.push_back({&index, source_fd});
+        chunk_by_time(clip, interleave);
+        return virtual_file_t{fast_start_segments(std::move(clip), sources, ftyp)};
+    }
+}